@@ -27,7 +27,7 @@
 
 namespace squish {
 
-ColourSet::ColourSet( u8 const* rgba, int mask, int flags )
+ColourSet::ColourSet( u8 const* rgba, int mask, int flags, float const* weights )
   : m_count( 0 ), 
 	m_transparent( false )
 {
@@ -70,7 +70,7 @@ ColourSet::ColourSet( u8 const* rgba, int mask, int flags )
 
 				// add the point
 				m_points[m_count] = Vec3( x, y, z );
-				m_weights[m_count] = ( weightByAlpha ? w : 1.0f );
+				m_weights[m_count] = ( weightByAlpha ? w : 1.0f )*( weights ? weights[i] : 1.0f );
 				m_remap[i] = m_count;
 				
 				// advance
@@ -94,7 +94,7 @@ ColourSet::ColourSet( u8 const* rgba, int mask, int flags )
 				float w = ( float )( rgba[4*i + 3] + 1 ) / 256.0f;
 
 				// map to this point and increase the weight
-				m_weights[index] += ( weightByAlpha ? w : 1.0f );
+				m_weights[index] += ( weightByAlpha ? w : 1.0f )*( weights ? weights[i] : 1.0f );
 				m_remap[i] = index;
 				break;
 			}
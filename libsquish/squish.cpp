@@ -51,20 +51,14 @@ static int FixFlags( int flags )
 	return method | fit | extra;
 }
 
-void CompressMasked( u8 const* rgba, int mask, void* block, int flags, float* metric )
+static void CompressColourSet( ColourSet const& colours, u8 const* rgba, int mask, void* block, int flags, float* metric )
 {
-	// fix any bad flags
-	flags = FixFlags( flags );
-
 	// get the block locations
 	void* colourBlock = block;
 	void* alphaBock = block;
 	if( ( flags & ( kDxt3 | kDxt5 ) ) != 0 )
 		colourBlock = reinterpret_cast< u8* >( block ) + 8;
 
-	// create the minimal point set
-	ColourSet colours( rgba, mask, flags );
-	
 	// check the compression type and compress colour
 	if( colours.GetCount() == 1 )
 	{
@@ -92,6 +86,34 @@ void CompressMasked( u8 const* rgba, int mask, void* block, int flags, float* me
 		CompressAlphaDxt5( rgba, mask, alphaBock );
 }
 
+void CompressMasked( u8 const* rgba, int mask, void* block, int flags, float* metric )
+{
+	// fix any bad flags
+	flags = FixFlags( flags );
+
+	// create the minimal point set
+	ColourSet colours( rgba, mask, flags );
+
+	CompressColourSet( colours, rgba, mask, block, flags, metric );
+}
+
+void CompressWeighted( u8 const* rgba, float const* weights, void* block, int flags, float* metric )
+{
+	// fix any bad flags
+	flags = FixFlags( flags );
+
+	// the pixels without weight are left out as in CompressMasked
+	int mask = 0;
+	for( int i = 0; i < 16; ++i )
+		if( weights[i] > 0.0f )
+			mask |= 1 << i;
+
+	// create the minimal point set
+	ColourSet colours( rgba, mask, flags, weights );
+
+	CompressColourSet( colours, rgba, mask, block, flags, metric );
+}
+
 void Decompress( u8* rgba, void const* block, int flags )
 {
 	// fix any bad flags
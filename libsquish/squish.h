@@ -108,6 +108,26 @@ void CompressMasked( u8 const* rgba, int mask, void* block, int flags, float* me
 
 // -----------------------------------------------------------------------------
 
+/*! @brief Compresses a 4x4 block of pixels with a weight per pixel.
+
+	@param rgba		The rgba values of the 16 source pixels.
+	@param weights	The weights of the 16 source pixels.
+	@param block	Storage for the compressed DXT block.
+	@param flags	Compression flags.
+	@param metric	An optional perceptual metric.
+	
+	Like CompressMasked, but each pixel counts in the fit of the colours with
+	its weight, a contiguous array of 16 floats. Pixels with a weight of zero or
+	less are not enabled, as if their bit in the mask were clear.
+	
+	The weights are used by kColourClusterFit and kColourIterativeClusterFit,
+	and by kColourRangeFit for the principal axis of the colours. When the
+	kWeightColourByAlpha flag is set, they multiply the alpha weights.
+*/
+void CompressWeighted( u8 const* rgba, float const* weights, void* block, int flags, float* metric = 0 );
+
+// -----------------------------------------------------------------------------
+
 /*! @brief Compresses a 4x4 block of pixels.
 
 	@param rgba		The rgba values of the 16 source pixels.
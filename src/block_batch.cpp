@@ -0,0 +1,325 @@
+#include "block_batch.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// 8 floats, one per block. The comparisons set all the bits of the lanes where they hold,
+// for vand(), vor() and select()
+#if defined(__AVX__)
+
+struct F8 {
+    __m256 v;
+    F8() {}
+    F8(__m256 x) : v(x) {}
+    F8(float x) : v(_mm256_set1_ps(x)) {}
+    static F8 load(const float *p) { return _mm256_load_ps(p); }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+};
+
+inline F8 operator+(F8 a, F8 b) { return _mm256_add_ps(a.v, b.v); }
+inline F8 operator-(F8 a, F8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline F8 operator*(F8 a, F8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline F8 operator/(F8 a, F8 b) { return _mm256_div_ps(a.v, b.v); }
+inline F8 operator<(F8 a, F8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline F8 vmin(F8 a, F8 b) { return _mm256_min_ps(a.v, b.v); }
+inline F8 vmax(F8 a, F8 b) { return _mm256_max_ps(a.v, b.v); }
+inline F8 vsqrt(F8 a) { return _mm256_sqrt_ps(a.v); }
+inline F8 vabs(F8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline F8 vand(F8 a, F8 b) { return _mm256_and_ps(a.v, b.v); }
+inline F8 vor(F8 a, F8 b) { return _mm256_or_ps(a.v, b.v); }
+inline F8 select(F8 m, F8 a, F8 b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+
+#elif defined(__SSE2__)
+
+struct F8 {
+    __m128 lo, hi;
+    F8() {}
+    F8(__m128 l, __m128 h) : lo(l), hi(h) {}
+    F8(float x) : lo(_mm_set1_ps(x)), hi(lo) {}
+    static F8 load(const float *p) { return F8(_mm_load_ps(p), _mm_load_ps(p + 4)); }
+    void store(float *p) const { _mm_store_ps(p, lo); _mm_store_ps(p + 4, hi); }
+};
+
+#define F8_OP(name, op) inline F8 name(F8 a, F8 b) { return F8(op(a.lo, b.lo), op(a.hi, b.hi)); }
+F8_OP(operator+, _mm_add_ps)
+F8_OP(operator-, _mm_sub_ps)
+F8_OP(operator*, _mm_mul_ps)
+F8_OP(operator/, _mm_div_ps)
+F8_OP(operator<, _mm_cmplt_ps)
+F8_OP(vmin, _mm_min_ps)
+F8_OP(vmax, _mm_max_ps)
+F8_OP(vand, _mm_and_ps)
+F8_OP(vor, _mm_or_ps)
+#undef F8_OP
+
+inline F8 vsqrt(F8 a) { return F8(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)); }
+inline F8 vabs(F8 a) { __m128 s = _mm_set1_ps(-0.0f); return F8(_mm_andnot_ps(s, a.lo), _mm_andnot_ps(s, a.hi)); }
+inline F8 select(F8 m, F8 a, F8 b)
+{
+    return F8(_mm_or_ps(_mm_and_ps(m.lo, a.lo), _mm_andnot_ps(m.lo, b.lo)),
+              _mm_or_ps(_mm_and_ps(m.hi, a.hi), _mm_andnot_ps(m.hi, b.hi)));
+}
+
+#else
+
+// the lanes of the masks are kept as bits
+struct F8 {
+    float v[8];
+    F8() {}
+    F8(float x) { for (int k = 0; k < 8; ++k) v[k] = x; }
+    static F8 load(const float *p) { F8 r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void store(float *p) const { std::memcpy(p, v, sizeof(v)); }
+};
+
+inline uint32_t bitsOf(float x) { uint32_t u; std::memcpy(&u, &x, 4); return u; }
+inline float fromBits(uint32_t u) { float x; std::memcpy(&x, &u, 4); return x; }
+
+#define F8_OP(name, expr) inline F8 name(F8 a, F8 b) { F8 r; for (int k = 0; k < 8; ++k) { float x = a.v[k], y = b.v[k]; r.v[k] = (expr); } return r; }
+F8_OP(operator+, x + y)
+F8_OP(operator-, x - y)
+F8_OP(operator*, x * y)
+F8_OP(operator/, x / y)
+F8_OP(operator<, fromBits(x < y ? ~0u : 0u))
+F8_OP(vmin, y < x ? y : x)
+F8_OP(vmax, x < y ? y : x)
+F8_OP(vand, fromBits(bitsOf(x) & bitsOf(y)))
+F8_OP(vor, fromBits(bitsOf(x) | bitsOf(y)))
+#undef F8_OP
+
+inline F8 vsqrt(F8 a) { F8 r; for (int k = 0; k < 8; ++k) r.v[k] = std::sqrt(a.v[k]); return r; }
+inline F8 vabs(F8 a) { F8 r; for (int k = 0; k < 8; ++k) r.v[k] = std::fabs(a.v[k]); return r; }
+inline F8 select(F8 m, F8 a, F8 b) { F8 r; for (int k = 0; k < 8; ++k) r.v[k] = bitsOf(m.v[k]) ? a.v[k] : b.v[k]; return r; }
+
+#endif
+
+inline F8 clampColor(F8 c)
+{
+    return vmin(vmax(c, F8(0.0f)), F8(255.0f));
+}
+
+// true if any lane of m is set
+#if defined(__AVX__)
+inline bool any(F8 m) { return _mm256_movemask_ps(m.v) != 0; }
+#elif defined(__SSE2__)
+inline bool any(F8 m) { return _mm_movemask_ps(_mm_or_ps(m.lo, m.hi)) != 0; }
+#else
+inline bool any(F8 m) { for (int k = 0; k < 8; ++k) if (bitsOf(m.v[k])) return true; return false; }
+#endif
+
+// enough for the dominant axis of a 3x3 covariance, the rest barely moves the endpoints
+const int powerIterations = 8;
+
+// channel c of pixel i of block k is at px[c][i][k]; sel[i][k] is 1 for the masked pixels
+typedef float Pixels[3][16][8];
+typedef float Selection[16][8];
+
+// getQuantizationMask() of the 16 pixels: the palette code of the closest color of the
+// endpoints c0, c1, from the projection on the segment, and its weights w0, w1
+void assignPixels(const Pixels& px, const F8 *c0, const F8 *c1, F8 *bit, F8 *w0, F8 *w1)
+{
+    F8 d[3] = { c1[0] - c0[0], c1[1] - c0[1], c1[2] - c0[2] };
+    F8 len2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    // c0 == c1 projects everything on c0
+    F8 scale = select(F8(0.0f) < len2, F8(3.0f) / len2, F8(0.0f));
+
+    for (int i = 0; i < 16; ++i) {
+        F8 t = ((F8::load(px[0][i]) - c0[0]) * d[0] + (F8::load(px[1][i]) - c0[1]) * d[1] + (F8::load(px[2][i]) - c0[2]) * d[2]) * scale;
+        // thirds 0..3, the entries are at t = 0, 1, 2, 3
+        F8 past1 = F8(0.5f) < t;
+        F8 past2 = F8(1.5f) < t;
+        F8 past3 = F8(2.5f) < t;
+        bit[i] = select(past3, F8(QMASK_C1), select(past2, F8(QMASK_C0_13_C1_23), select(past1, F8(QMASK_C0_23_C1_13), F8(QMASK_C0))));
+        w1[i] = select(past3, F8(1.0f), select(past2, F8(2.0f / 3.0f), select(past1, F8(1.0f / 3.0f), F8(0.0f))));
+        w0[i] = select(past3, F8(0.0f), select(past2, F8(1.0f / 3.0f), select(past1, F8(2.0f / 3.0f), F8(1.0f))));
+    }
+}
+
+// optimizeEndpoints(): in the lanes of refit, c0 and c1 get the least squares endpoints for the
+// weights w0, w1 of the masked pixels (o is their mean, n their number). Returns the squared error
+F8 refitEndpoints(const Pixels& px, const Selection& sel, F8 n, const F8 *o, const F8 *w0, const F8 *w1, F8 refit, F8 *c0, F8 *c1)
+{
+    F8 a00(0.0f), a01(0.0f), a11(0.0f), sw0(0.0f), sw1(0.0f);
+    F8 b0[3] = { F8(0.0f), F8(0.0f), F8(0.0f) };
+    F8 b1[3] = { F8(0.0f), F8(0.0f), F8(0.0f) };
+    for (int i = 0; i < 16; ++i) {
+        F8 s = F8::load(sel[i]);
+        F8 x = w0[i] * s;
+        F8 y = w1[i] * s;
+        a00 = a00 + x * x;
+        a01 = a01 + x * y;
+        a11 = a11 + y * y;
+        sw0 = sw0 + x;
+        sw1 = sw1 + y;
+        for (int c = 0; c < 3; ++c) {
+            F8 p = F8::load(px[c][i]);
+            b0[c] = b0[c] + x * p;
+            b1[c] = b1[c] + y * p;
+        }
+    }
+
+    // when all the pixels share their weights only that mix of the endpoints is determined,
+    // and both endpoints move so that it becomes the mean
+    F8 det = a00 * a11 - a01 * a01;
+    F8 solvable = F8(1e-4f) * a00 * a11 < det;
+    F8 invDet = F8(1.0f) / select(solvable, det, F8(1.0f));
+    F8 invN = F8(1.0f) / vmax(n, F8(1.0f));
+    for (int c = 0; c < 3; ++c) {
+        F8 x0 = (a11 * b0[c] - a01 * b1[c]) * invDet;
+        F8 x1 = (a00 * b1[c] - a01 * b0[c]) * invDet;
+        F8 delta = o[c] - (sw0 * c0[c] + sw1 * c1[c]) * invN;
+        x0 = select(solvable, x0, c0[c] + delta);
+        x1 = select(solvable, x1, c1[c] + delta);
+        c0[c] = select(refit, clampColor(x0), c0[c]);
+        c1[c] = select(refit, clampColor(x1), c1[c]);
+    }
+
+    F8 r(0.0f);
+    for (int i = 0; i < 16; ++i) {
+        F8 s = F8::load(sel[i]);
+        for (int c = 0; c < 3; ++c) {
+            F8 d = (w0[i] * c0[c] + w1[i] * c1[c] - F8::load(px[c][i])) * s;
+            r = r + d * d;
+        }
+    }
+    return r;
+}
+
+}
+
+void computeBlocks8(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, int refinements, Block *out)
+{
+    alignas(32) Pixels px;
+    alignas(32) Selection sel;
+    for (int k = 0; k < 8; ++k) {
+        for (int i = 0; i < 16; ++i) {
+            const vec3& c = cblk[16 * k + i];
+            px[0][i][k] = c.x;
+            px[1][i][k] = c.y;
+            px[2][i][k] = c.z;
+            sel[i][k] = ((!bitmask) || (mblk[16 * k + i] & bitmask)) ? 1.0f : 0.0f;
+        }
+    }
+
+    // mean of the masked pixels, a block without any is the single color (0, 0, 0)
+    F8 n(0.0f);
+    F8 o[3] = { F8(0.0f), F8(0.0f), F8(0.0f) };
+    for (int i = 0; i < 16; ++i) {
+        F8 s = F8::load(sel[i]);
+        n = n + s;
+        for (int c = 0; c < 3; ++c)
+            o[c] = o[c] + s * F8::load(px[c][i]);
+    }
+    F8 invN = F8(1.0f) / vmax(n, F8(1.0f));
+    for (int c = 0; c < 3; ++c)
+        o[c] = o[c] * invN;
+
+    // covariance: xx, xy, xz, yy, yz, zz
+    F8 cov[6] = { F8(0.0f), F8(0.0f), F8(0.0f), F8(0.0f), F8(0.0f), F8(0.0f) };
+    for (int i = 0; i < 16; ++i) {
+        F8 s = F8::load(sel[i]);
+        F8 dx = (F8::load(px[0][i]) - o[0]) * s;
+        F8 dy = (F8::load(px[1][i]) - o[1]) * s;
+        F8 dz = (F8::load(px[2][i]) - o[2]) * s;
+        cov[0] = cov[0] + dx * dx;
+        cov[1] = cov[1] + dx * dy;
+        cov[2] = cov[2] + dx * dz;
+        cov[3] = cov[3] + dy * dy;
+        cov[4] = cov[4] + dy * dz;
+        cov[5] = cov[5] + dz * dz;
+    }
+
+    // principal axis by power iteration, from the column with the largest diagonal entry
+    F8 vx = cov[0], vy = cov[1], vz = cov[2];
+    F8 useY = cov[0] < cov[3];
+    vx = select(useY, cov[1], vx);
+    vy = select(useY, cov[3], vy);
+    vz = select(useY, cov[4], vz);
+    F8 useZ = vmax(cov[0], cov[3]) < cov[5];
+    vx = select(useZ, cov[2], vx);
+    vy = select(useZ, cov[4], vy);
+    vz = select(useZ, cov[5], vz);
+    for (int it = 0; it < powerIterations; ++it) {
+        F8 x = cov[0] * vx + cov[1] * vy + cov[2] * vz;
+        F8 y = cov[1] * vx + cov[3] * vy + cov[4] * vz;
+        F8 z = cov[2] * vx + cov[4] * vy + cov[5] * vz;
+        // largest component to 1, so that the values stay in range
+        F8 m = vmax(vmax(vabs(x), vabs(y)), vabs(z));
+        F8 s = F8(1.0f) / vmax(m, F8(1e-30f));
+        vx = x * s;
+        vy = y * s;
+        vz = z * s;
+    }
+    // no spread (one pixel, or all the same) leaves v at 0, the axis is then x as in fitLine()
+    F8 len2 = vx * vx + vy * vy + vz * vz;
+    F8 axis = F8(0.5f) < len2;
+    F8 invLen = F8(1.0f) / vsqrt(vmax(len2, F8(1.0f)));
+    F8 d[3] = { select(axis, vx * invLen, F8(1.0f)), select(axis, vy * invLen, F8(0.0f)), select(axis, vz * invLen, F8(0.0f)) };
+
+    // findColorInterval(): the range of the projections, including the mean
+    F8 tmin(0.0f), tmax(0.0f);
+    for (int i = 0; i < 16; ++i) {
+        F8 t = (F8::load(px[0][i]) - o[0]) * d[0] + (F8::load(px[1][i]) - o[1]) * d[1] + (F8::load(px[2][i]) - o[2]) * d[2];
+        t = t * F8::load(sel[i]);
+        tmin = vmin(tmin, t);
+        tmax = vmax(tmax, t);
+    }
+    F8 c0[3], c1[3];
+    for (int c = 0; c < 3; ++c) {
+        c0[c] = clampColor(o[c] + tmin * d[c]);
+        c1[c] = clampColor(o[c] + tmax * d[c]);
+    }
+
+    F8 bit[16], w0[16], w1[16];
+    assignPixels(px, c0, c1, bit, w0, w1);
+
+    // with more than 2 pixels the endpoints are refitted to the bits, then the bits are
+    // reassigned and so on while the error goes down, as in computeBlock()
+    F8 refine = F8(2.5f) < n;
+    F8 rmin = refitEndpoints(px, sel, n, o, w0, w1, refine, c0, c1);
+    for (int it = 0; it < refinements && any(refine); ++it) {
+        F8 nc0[3] = { c0[0], c0[1], c0[2] };
+        F8 nc1[3] = { c1[0], c1[1], c1[2] };
+        F8 nbit[16];
+        assignPixels(px, nc0, nc1, nbit, w0, w1);
+        // the same bits give the same endpoints
+        F8 changed(0.0f);
+        for (int i = 0; i < 16; ++i)
+            changed = vor(changed, vor(nbit[i] < bit[i], bit[i] < nbit[i]));
+        refine = vand(refine, changed);
+        if (!any(refine))
+            break;
+        F8 r = refitEndpoints(px, sel, n, o, w0, w1, refine, nc0, nc1);
+        refine = vand(refine, r < rmin);
+        rmin = select(refine, r, rmin);
+        for (int c = 0; c < 3; ++c) {
+            c0[c] = select(refine, nc0[c], c0[c]);
+            c1[c] = select(refine, nc1[c], c1[c]);
+        }
+        for (int i = 0; i < 16; ++i)
+            bit[i] = select(refine, nbit[i], bit[i]);
+    }
+
+    alignas(32) float bits[16][8];
+    for (int i = 0; i < 16; ++i)
+        bit[i].store(bits[i]);
+
+    alignas(32) float e0[3][8], e1[3][8];
+    for (int c = 0; c < 3; ++c) {
+        c0[c].store(e0[c]);
+        c1[c].store(e1[c]);
+    }
+    for (int k = 0; k < 8; ++k) {
+        out[k].c0 = vec3(e0[0][k], e0[1][k], e0[2][k]);
+        out[k].c1 = vec3(e1[0][k], e1[1][k], e1[2][k]);
+        for (int i = 0; i < 16; ++i)
+            out[k].bit[i] = uint8_t(bits[i][k]);
+    }
+}
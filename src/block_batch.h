@@ -0,0 +1,17 @@
+#ifndef BLOCK_BATCH_H
+#define BLOCK_BATCH_H
+
+#include <cstdint>
+
+#include "compressed_image.h"
+
+// Encodes 8 blocks at once, one per SIMD lane (AVX, or two SSE registers, or plain floats).
+// The steps are those of the scalar encoder in compressed_image.cpp, in single precision:
+// the principal axis of the covariance of the masked pixels is found by power iteration
+// instead of an eigen solver, the colors are projected on it, the pixels get the closest
+// of the 4 palette entries, and with more than 2 pixels the endpoints are refitted by the
+// 2x2 normal equations and the pixels reassigned, up to refinements times.
+// cblk and mblk hold the 16 pixels (by row) of block 0, then block 1...
+void computeBlocks8(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, int refinements, Block *out);
+
+#endif // BLOCK_BATCH_H
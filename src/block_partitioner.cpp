@@ -26,40 +26,38 @@ void BlockPartitioner::init(int resx, int resy)
 
 void BlockPartitioner::computePartitions(const Mesh& m)
 {
-    using ::Seam;
-
-    vec2 uvscale(resx, resy);
-    for (const Seam& s : m.seam) {
-        double d = m.maxLength(s, uvscale);
-        std::set<int> ind0, ind1;
-        for (double t = 0; t <= 1; t += 1 / (SEAM_SAMPLING_FACTOR*d)) {
-            vec2 p0, p1, w;
-
-            getLinearInterpolationData(m.uvpos(s.first, t) * uvscale, p0, p1, w);
-            ind0.insert(CompressedImage::getBlockIndex(int(p0.x), int(p0.y), resx, resy));
-            ind0.insert(CompressedImage::getBlockIndex(int(p1.x), int(p0.y), resx, resy));
-            ind0.insert(CompressedImage::getBlockIndex(int(p0.x), int(p1.y), resx, resy));
-            ind0.insert(CompressedImage::getBlockIndex(int(p1.x), int(p1.y), resx, resy));
-
-            getLinearInterpolationData(m.uvpos(s.second, t) * uvscale, p0, p1, w);
-            ind1.insert(CompressedImage::getBlockIndex(int(p0.x), int(p0.y), resx, resy));
-            ind1.insert(CompressedImage::getBlockIndex(int(p1.x), int(p0.y), resx, resy));
-            ind1.insert(CompressedImage::getBlockIndex(int(p0.x), int(p1.y), resx, resy));
-            ind1.insert(CompressedImage::getBlockIndex(int(p1.x), int(p1.y), resx, resy));
+    computePartitions(SeamSampleSet(m, resx, resy));
+}
+
+void BlockPartitioner::computePartitions(const SeamSampleSet& samples)
+{
+    assert(samples.resx == resx && samples.resy == resy);
+
+    seam = samples.seam;
+    for (int k = 0; k < samples.numSeams(); ++k) {
+        std::set<int> ind[2];
+        for (int i = samples.seamBegin[k]; i < samples.seamBegin[k+1]; ++i) {
+            for (int side = 0; side < 2; ++side) {
+                for (int corner = 0; corner < 4; ++corner) {
+                    int x = samples.pixelX(side, corner, i);
+                    int y = samples.pixelY(side, corner, i);
+                    ind[side].insert(CompressedImage::getBlockIndex(x, y, resx, resy));
+                }
+            }
         }
-        assert(ind0.size() > 0);
-        assert(ind1.size() > 0);
+        assert(ind[0].size() > 0);
+        assert(ind[1].size() > 0);
 
-        int k0 = setUnion(ind0);
-        blocks[k0].seams.push_back(s);
-        int k1 = setUnion(ind1);
+        int k0 = setUnion(ind[0]);
+        blocks[k0].seams.push_back(k);
+        int k1 = setUnion(ind[1]);
         setUnion(k0, k1);
     }
 }
 
 void BlockPartitioner::printSizes()
 {
-    std::map<int, std::vector<Seam>> partitions;
+    std::map<int, std::vector<int>> partitions;
     for (int i = 0; i < blocks.size(); ++i) {
         if (blocks[i].parent != CLOSED_BLOCK) {
             int k = setFind(i);
@@ -83,6 +81,17 @@ void BlockPartitioner::printSizes()
 }
 
 std::vector<std::vector<Seam>> BlockPartitioner::getPartitions()
+{
+    std::vector<std::vector<Seam>> vsv;
+    for (const std::vector<int>& partition : getPartitionSeamIndices()) {
+        vsv.push_back(std::vector<Seam>());
+        for (int k : partition)
+            vsv.back().push_back(seam[k]);
+    }
+    return vsv;
+}
+
+std::vector<std::vector<int>> BlockPartitioner::getPartitionSeamIndices()
 {
     std::map<int, std::vector<int>> partitions;
     for (int i = 0; i < blocks.size(); ++i) {
@@ -92,15 +101,15 @@ std::vector<std::vector<Seam>> BlockPartitioner::getPartitions()
         }
     }
 
-    std::vector<std::vector<Seam>> vsv;
+    std::vector<std::vector<int>> vsv;
     for (auto entry : partitions) {
-        vsv.push_back(std::vector<Seam>());
+        vsv.push_back(std::vector<int>());
         for (int k : entry.second) {
             vsv.back().insert(vsv.back().end(), blocks[k].seams.begin(), blocks[k].seams.end());
         }
     }
 
-    std::sort(vsv.begin(), vsv.end(), [](const std::vector<Seam>& v1, const std::vector<Seam>& v2) { return v1.size() > v2.size(); });
+    std::sort(vsv.begin(), vsv.end(), [](const std::vector<int>& v1, const std::vector<int>& v2) { return v1.size() > v2.size(); });
     return vsv;
 }
 
@@ -9,18 +9,20 @@
 #include "mesh.h"
 #include "compressed_image.h"
 #include "sampling.h"
+#include "seam_sample_set.h"
 
 class BlockPartitioner
 {
     struct BlockInfo {
         int parent;
         int size;
-        std::vector<Seam> seams;
+        std::vector<int> seams; // indices into seam
     };
 
     int resx;
     int resy;
     std::vector<BlockInfo> blocks;
+    std::vector<Seam> seam;
 
 public:
 
@@ -28,9 +30,11 @@ public:
 
     void init(int xres, int yres);
     void computePartitions(const Mesh& m);
+    void computePartitions(const SeamSampleSet& samples);
     void printSizes();
 
     std::vector<std::vector<Seam>> getPartitions();
+    std::vector<std::vector<int>> getPartitionSeamIndices(); // indices into Mesh::seam
 
 private:
 
@@ -6,7 +6,7 @@
 #include <chrono>
 #include <iostream>
 
-void CompressWithSquish(const Image& in, Image& out)
+void CompressWithSquish(const Image& in, Image& out, float seamWeight)
 {
     assert(in.resx % 4 == 0);
     assert(in.resy % 4 == 0);
@@ -18,19 +18,32 @@ void CompressWithSquish(const Image& in, Image& out)
 
     for (int y = 0; y < out.resy / 4; ++y)
     for (int x = 0; x < out.resx / 4; ++x) {
-        std::vector<squish::u8> cblk;
+        squish::u8 cblk[16 * 4];
+        float weights[16];
         for (int h = 0; h < 4; ++h)
         for (int k = 0; k < 4; ++k) {
+            int i = 4 * h + k;
             vec3 c = in.pixel(4 * x + k, 4 * y + h);
-            cblk.push_back(squish::u8(c.r));
-            cblk.push_back(squish::u8(c.g));
-            cblk.push_back(squish::u8(c.b));
-            cblk.push_back(255);
+            cblk[4 * i] = squish::u8(c.r);
+            cblk[4 * i + 1] = squish::u8(c.g);
+            cblk[4 * i + 2] = squish::u8(c.b);
+            cblk[4 * i + 3] = 255;
+
+            uint8_t mask = in.mask(4 * x + k, 4 * y + h);
+            if (mask & Image::MaskBit::Seam)
+                weights[i] = seamWeight;
+            else if (mask & Image::MaskBit::Internal)
+                weights[i] = 1;
+            else
+                weights[i] = 0;
         }
 
         CompressedBlock cb;
-        squish::Compress(cblk.data(), &cb, squish::kDxt1);
-        squish::Decompress(cblk.data(), &cb, squish::kDxt1);
+        if (seamWeight > 0)
+            squish::CompressWeighted(cblk, weights, &cb, squish::kDxt1);
+        else
+            squish::Compress(cblk, &cb, squish::kDxt1);
+        squish::Decompress(cblk, &cb, squish::kDxt1);
 
         for (int h = 0; h < 4; ++h)
         for (int k = 0; k < 4; ++k) {
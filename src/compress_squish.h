@@ -3,6 +3,9 @@
 
 class Image;
 
-void CompressWithSquish(const Image& in, Image& out);
+// seamWeight > 0 weights the pixels in the fit of the block colors by their mask: seamWeight for
+// the seam pixels, 1 for the internal ones and 0 for the others, which can take any color.
+// seamWeight = 0 weights every pixel the same
+void CompressWithSquish(const Image& in, Image& out, float seamWeight = 0);
 
 #endif // COMPRESS_SQUISH_H
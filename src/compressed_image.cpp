@@ -1,22 +1,45 @@
 #include "compressed_image.h"
+#include "block_batch.h"
 #include "image.h"
 #include "line.h"
+#include "parallel.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
 
 #include <glm/geometric.hpp>
 
-#include <Eigen/Core>
-#include <Eigen/Dense>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+// save() writes through a shared mapping of the file
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define DDS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 
-static CompressedBlock encodeBlock(const Block& blk);
-static float optimizeEndpoints(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, Block& blk);
-static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line, vec3& c0, vec3& c1);
+static CompressedBlock encodeBlock(const PackedBlock& pb);
+static PackedBlock packBlock(const Block& blk);
+static PackedBlock decodeBlock(const CompressedBlock& cb);
+static Block unpackBlock(const PackedBlock& pb);
+static inline unsigned char packedCode(const PackedBlock& pb, int i);
+static void loadBlock(const Image& img, int bx, int by, vec3 *cblk, uint8_t *mblk);
+static float optimizeEndpoints(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, Block& blk);
+static void findColorInterval(const vec3 *cblk, int n, const Line3& line, vec3& c0, vec3& c1);
 static unsigned char getQuantizationMask(const vec3& color, const vec3& c0, const vec3& c1);
 static unsigned char swappedMask(unsigned char mask);
-static Block computeBlock(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, uint8_t bitmask);
+static Block computeBlock(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, int refinements);
 static vec3 getColor(const Block& blk, int i);
 
 static uint16_t quantizeColor(const vec3& color);
@@ -39,7 +62,7 @@ vec2 CompressedImage::getWeights(unsigned char bitmask)
     }
 }
 
-void CompressedImage::initialize(const Image& img, uint8_t bitmask)
+void CompressedImage::initialize(const Image& img, uint8_t bitmask, bool batched)
 {
     assert(img.resx % 4 == 0);
     assert(img.resy % 4 == 0);
@@ -47,20 +70,67 @@ void CompressedImage::initialize(const Image& img, uint8_t bitmask)
     resx = img.resx;
     resy = img.resy;
 
-    data.clear();
-    data.reserve((resx * resy) / 16);
+    data.resize(getNumberOfBlocks(resx, resy));
+    mipmaps.clear();
+    verbatimBlocks.clear();
+
+    // every block row is written by one task, the blocks are independent
+    const int bw = resx / 4;
+    parallelFor(resy / 4, [&](int y, int) {
+        if (batched) {
+            // the lanes past the end of the row repeat its last block
+            vec3 cblk[8 * 16];
+            uint8_t mblk[8 * 16];
+            Block blk[8];
+            for (int x = 0; x < bw; x += 8) {
+                for (int k = 0; k < 8; ++k)
+                    loadBlock(img, std::min(x + k, bw - 1), y, cblk + 16 * k, mblk + 16 * k);
+                computeBlocks8(cblk, mblk, bitmask, endpointRefinements, blk);
+                for (int k = 0; k < std::min(8, bw - x); ++k)
+                    data[y * bw + x + k] = packBlock(blk[k]);
+            }
+        } else {
+            vec3 cblk[16];
+            uint8_t mblk[16];
+            for (int x = 0; x < bw; ++x) {
+                loadBlock(img, x, y, cblk, mblk);
+                data[y * bw + x] = packBlock(computeBlock(cblk, mblk, bitmask, endpointRefinements));
+            }
+        }
+    });
+}
 
-    for (int y = 0; y < resy / 4; ++y)
-    for (int x = 0; x < resx / 4; ++x) {
-        std::vector<vec3> cblk;
-        std::vector<uint8_t> mblk;
-        for (int h = 0; h < 4; ++h)
-        for (int k = 0; k < 4; ++k) {
-            cblk.push_back(img.pixel(4 * x + k, 4 * y + h));
-            mblk.push_back(img.mask(4 * x + k, 4 * y + h));
+void CompressedImage::benchmarkEncoders(const Image& img, uint8_t bitmask, int refinements)
+{
+    std::cout << "Block encoders, " << threadCount() << " threads, " << refinements << " endpoint refinements:" << std::endl;
+
+    for (int batched = 0; batched < 2; ++batched) {
+        // best of 3
+        CompressedImage cimg;
+        cimg.endpointRefinements = refinements;
+        double seconds = 0;
+        for (int run = 0; run < 3; ++run) {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            cimg.initialize(img, bitmask, batched);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            double s = std::chrono::duration<double>(t1 - t0).count();
+            seconds = (run == 0) ? s : std::min(seconds, s);
+        }
+
+        // RMS error of the masked pixels
+        double err = 0;
+        long n = 0;
+        for (int y = 0; y < img.resy; ++y)
+        for (int x = 0; x < img.resx; ++x) {
+            if ((!bitmask) || (img.mask(x, y) & bitmask)) {
+                vec3 d = cimg.pixel(x, y) - img.pixel(x, y);
+                err += glm::dot(d, d);
+                n++;
+            }
         }
-        Block blk = computeBlock(cblk, mblk, bitmask);
-        data.push_back(blk);
+
+        std::cout << "  " << (batched ? "batched" : "scalar ") << ": " << long(cimg.nblk() / seconds) << " blocks/s, "
+                  << seconds * 1000 << " ms, rms error = " << std::sqrt(err / std::max(n, 1l)) << std::endl;
     }
 }
 
@@ -70,17 +140,15 @@ std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& i
     assert(resy == img.resy);
 
     std::vector<BlockErrorData> perBlockError;
+    perBlockError.reserve(nblk());
     for (int by = 0; by < resy / 4; ++by)
     for (int bx = 0; bx < resx / 4; ++bx) {
-        std::vector<vec3> cblk;
-        std::vector<uint8_t> mblk;
-        for (int h = 0; h < 4; ++h)
-        for (int k = 0; k < 4; ++k) {
-            cblk.push_back(img.pixel(4 * bx + k, 4 * by + h));
-            mblk.push_back(img.mask(4 * bx + k, 4 * by + h));
-        }
+        vec3 cblk[16];
+        uint8_t mblk[16];
+        loadBlock(img, bx, by, cblk, mblk);
 
         int blkIndex = getBlockIndex(4 * bx, 4 * by);
+        Block blk = getBlock(blkIndex);
 
         float minError = 1e10;
         float maxError = 0;
@@ -89,7 +157,7 @@ std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& i
         for (unsigned i = 0; i < 16; ++i) {
             if (mblk[i] & (Image::MaskBit::Internal | Image::MaskBit::Seam)) {
                 n++;
-                vec3 c = getColor(data[blkIndex], i);
+                vec3 c = getColor(blk, i);
                 vec3 src = cblk[i];
                 float dist = glm::distance(c, src);
                 minError = std::min(minError, dist);
@@ -106,11 +174,54 @@ std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& i
     return perBlockError;
 }
 
+// halves the size of src into dst, averaging 2x2 pixels
+static void halveImage(const Image& src, Image& dst)
+{
+    dst.resize(src.resx / 2, src.resy / 2);
+    parallelFor(dst.resy, [&](int y, int) {
+        for (int x = 0; x < dst.resx; ++x)
+            dst.pixel(x, y) = 0.25f * (src.pixel(2 * x, 2 * y) + src.pixel(2 * x + 1, 2 * y)
+                                     + src.pixel(2 * x, 2 * y + 1) + src.pixel(2 * x + 1, 2 * y + 1));
+    });
+}
+
+void CompressedImage::generateMipmaps(const Image& img, int levels, bool batched)
+{
+    assert(img.resx == resx);
+    assert(img.resy == resy);
+
+    mipmaps.clear();
+    verbatimBlocks.erase(verbatimBlocks.lower_bound(nblk()), verbatimBlocks.end());
+
+    Image halves[2];
+    const Image *src = &img;
+    for (int l = 1; levels == 0 || l < levels; ++l) {
+        int w = resx >> l;
+        int h = resy >> l;
+        if (w < 4 || h < 4 || w % 4 != 0 || h % 4 != 0)
+            break;
+
+        Image& dst = halves[l % 2];
+        halveImage(*src, dst);
+        src = &dst;
+
+        CompressedImage level;
+        level.endpointRefinements = endpointRefinements;
+        level.initialize(dst, 0, batched);
+        mipmaps.push_back(std::move(level.data));
+    }
+}
+
+int CompressedImage::mipLevels() const
+{
+    return 1 + mipmaps.size();
+}
+
 DDS_PIXELFORMAT CompressedImage::generatePixelFormat() const
 {
     DDS_PIXELFORMAT pf = {};
     pf.dwSize = 32;
-    pf.dwFlags = 0x4; // TODO
+    pf.dwFlags = 0x4; // DDPF_FOURCC
     pf.dwFourCC = ((uint32_t)('D')) | ((uint32_t)('X') << 8) | ((uint32_t)('T') << 16) | ((uint32_t)('1') << 24);
     pf.dwRGBBitCount = 0;
     pf.dwRBitMask = 0;
@@ -123,17 +234,21 @@ DDS_PIXELFORMAT CompressedImage::generatePixelFormat() const
 // https://docs.microsoft.com/en-us/windows/win32/direct3ddds/dx-graphics-dds-pguide
 DDS_HEADER CompressedImage::generateHeader() const
 {
+    const bool mipmapped = mipLevels() > 1;
+
     DDS_HEADER header = {};
     // set header
     header.dwSize = 124;
-    header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000; // TODO
+    // DDSD_CAPS, DDSD_HEIGHT, DDSD_WIDTH, DDSD_PIXELFORMAT, DDSD_LINEARSIZE, DDSD_MIPMAPCOUNT
+    header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (mipmapped ? 0x20000 : 0);
     header.dwHeight = resy;
     header.dwWidth = resx;
-    header.dwPitchOrLinearSize = 0;
+    header.dwPitchOrLinearSize = nblk() * sizeof(CompressedBlock); // of the first level
     header.dwDepth = 0;
-    header.dwMipMapCount = 1;
+    header.dwMipMapCount = mipLevels();
     //header.dwReserved1[11] = 0;
-    header.dwCaps = 0x1000; // TODO
+    // DDSCAPS_TEXTURE, DDSCAPS_COMPLEX and DDSCAPS_MIPMAP
+    header.dwCaps = 0x1000 | (mipmapped ? 0x8 | 0x400000 : 0);
     header.dwCaps2 = 0;
     header.dwCaps3 = 0;
     header.dwCaps4 = 0;
@@ -143,44 +258,225 @@ DDS_HEADER CompressedImage::generateHeader() const
     return header;
 }
 
-void CompressedImage::save(const char *filename) const
+size_t CompressedImage::ddsSize() const
+{
+    size_t blocks = data.size();
+    for (const std::vector<PackedBlock>& level : mipmaps)
+        blocks += level.size();
+    return sizeof(uint32_t) + sizeof(DDS_HEADER) + blocks * sizeof(CompressedBlock);
+}
+
+void CompressedImage::writeDDS(uint8_t *buf) const
 {
     uint32_t dwMagic = 0x20534444;
     DDS_HEADER dwHeader = generateHeader();
 
+    std::memcpy(buf, &dwMagic, sizeof(uint32_t));
+    buf += sizeof(uint32_t);
+
+    std::memcpy(buf, &dwHeader, sizeof(DDS_HEADER));
+    buf += sizeof(DDS_HEADER);
+
+    size_t first = 0; // index of the first block of the level in the file
+    for (int l = 0; l < mipLevels(); ++l) {
+        const std::vector<PackedBlock>& blocks = (l == 0) ? data : mipmaps[l - 1];
+        const int bw = (resx >> l) / 4;
+        parallelFor(blocks.size() / bw, [&](int by, int) {
+            uint8_t *p = buf + size_t(by) * bw * sizeof(CompressedBlock);
+            size_t rowFirst = first + size_t(by) * bw;
+            auto verbatim = verbatimBlocks.lower_bound(rowFirst);
+            for (int bx = 0; bx < bw; ++bx) {
+                CompressedBlock qb;
+                if (verbatim != verbatimBlocks.end() && verbatim->first == rowFirst + bx) {
+                    qb = verbatim->second;
+                    ++verbatim;
+                } else {
+                    qb = encodeBlock(blocks[by * bw + bx]);
+                }
+                std::memcpy(p + bx * sizeof(CompressedBlock), &qb, sizeof(CompressedBlock));
+            }
+        });
+        buf += blocks.size() * sizeof(CompressedBlock);
+        first += blocks.size();
+    }
+}
+
+void CompressedImage::save(const char *filename) const
+{
+    const size_t size = ddsSize();
+
+#ifdef DDS_MMAP
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            writeDDS(static_cast<uint8_t *>(p));
+            munmap(p, size);
+            close(fd);
+            return;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    std::vector<uint8_t> buf(size);
+    writeDDS(buf.data());
     std::ofstream dds(filename, std::ios::binary);
-    dds.write(reinterpret_cast<char *>(&dwMagic), sizeof(uint32_t));
-    dds.write(reinterpret_cast<char *>(&dwHeader), sizeof(DDS_HEADER));
-    for (const Block& blk : data) {
-        CompressedBlock qb = encodeBlock(blk);
-        dds.write(reinterpret_cast<char *>(&qb), sizeof(CompressedBlock));
+    dds.write(reinterpret_cast<char *>(buf.data()), size);
+}
+
+bool CompressedImage::read(const uint8_t *buf, size_t size)
+{
+    uint32_t dwMagic;
+    DDS_HEADER header;
+    if (size < sizeof(uint32_t) + sizeof(DDS_HEADER))
+        return false;
+    std::memcpy(&dwMagic, buf, sizeof(uint32_t));
+    std::memcpy(&header, buf + sizeof(uint32_t), sizeof(DDS_HEADER));
+
+    if (dwMagic != 0x20534444 || header.dwSize != 124)
+        return false;
+    if (!(header.ddspf.dwFlags & 0x4) || header.ddspf.dwFourCC != generatePixelFormat().dwFourCC)
+        return false;
+    if (header.dwWidth == 0 || header.dwHeight == 0 || header.dwWidth % 4 != 0 || header.dwHeight % 4 != 0)
+        return false;
+
+    const int w = header.dwWidth;
+    const int h = header.dwHeight;
+    const int levels = (header.dwFlags & 0x20000) ? std::max(header.dwMipMapCount, 1u) : 1;
+
+    std::vector<std::vector<PackedBlock>> blocks;
+    std::map<size_t, CompressedBlock> verbatim;
+    size_t offset = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    size_t index = 0;
+    for (int l = 0; l < levels; ++l) {
+        int lw = w >> l;
+        int lh = h >> l;
+        if (lw < 4 || lh < 4 || lw % 4 != 0 || lh % 4 != 0)
+            break;
+        size_t n = getNumberOfBlocks(lw, lh);
+        if (size - offset < n * sizeof(CompressedBlock))
+            break;
+
+        blocks.emplace_back(n);
+        for (size_t i = 0; i < n; ++i, ++index) {
+            CompressedBlock cb;
+            std::memcpy(&cb, buf + offset + i * sizeof(CompressedBlock), sizeof(CompressedBlock));
+            blocks.back()[i] = decodeBlock(cb);
+            CompressedBlock qb = encodeBlock(blocks.back()[i]);
+            if (std::memcmp(&qb, &cb, sizeof(CompressedBlock)) != 0)
+                verbatim[index] = cb;
+        }
+        offset += n * sizeof(CompressedBlock);
     }
-    dds.close();
+    if (blocks.empty())
+        return false;
+
+    resx = w;
+    resy = h;
+    data = std::move(blocks[0]);
+    mipmaps.clear();
+    for (unsigned l = 1; l < blocks.size(); ++l)
+        mipmaps.push_back(std::move(blocks[l]));
+    verbatimBlocks = std::move(verbatim);
+    return true;
 }
 
-int CompressedImage::write(uint8_t **bufptr) const
+bool CompressedImage::load(const char *filename)
 {
-    int allocsz = sizeof(uint32_t) + sizeof(DDS_HEADER) + nblk() * sizeof(CompressedBlock);
+    std::ifstream dds(filename, std::ios::binary);
+    if (!dds)
+        return false;
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(dds)), std::istreambuf_iterator<char>());
+    return read(buf.data(), buf.size());
+}
 
+int CompressedImage::write(uint8_t **bufptr) const
+{
+    int allocsz = ddsSize();
     *bufptr = new uint8_t[allocsz];
-    uint8_t *p = *bufptr;
+    writeDDS(*bufptr);
+    return allocsz;
+}
 
-    uint32_t dwMagic = 0x20534444;
-    DDS_HEADER dwHeader = generateHeader();
+// the colors of the 4 codes of pb, as pixel() computes them
+static void blockPalette(const PackedBlock& pb, vec3 *palette)
+{
+    const unsigned char codes[4] = { QMASK_C0, QMASK_C1, QMASK_C0_23_C1_13, QMASK_C0_13_C1_23 };
+    vec3 c0 = quantized2rgb(pb.c0);
+    vec3 c1 = quantized2rgb(pb.c1);
+    for (unsigned char code : codes)
+        palette[code] = glm::mix(c0, c1, CompressedImage::getWeights(code).y);
+}
 
-    std::memcpy(p, &dwMagic, sizeof(uint32_t));
-    p += sizeof(uint32_t);
+// the 4 pixels of codes bit[0..3] from the packed RGBA8 palette
+static inline void expandRow(const uint32_t *palette, const unsigned char *bit, uint8_t *out)
+{
+#ifdef __SSSE3__
+    // byte j of pixel i is byte 4 * bit[i] + j of the palette
+    __m128i pal = _mm_loadu_si128(reinterpret_cast<const __m128i *>(palette));
+    uint32_t codes;
+    std::memcpy(&codes, bit, 4);
+    __m128i idx = _mm_shuffle_epi8(_mm_cvtsi32_si128(codes), _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3));
+    idx = _mm_add_epi8(_mm_slli_epi32(idx, 2), _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_shuffle_epi8(pal, idx));
+#else
+    for (int i = 0; i < 4; ++i)
+        std::memcpy(out + 4 * i, &palette[bit[i]], 4);
+#endif
+}
 
-    std::memcpy(p, &dwHeader, sizeof(DDS_HEADER));
-    p += sizeof(DDS_HEADER);
+void CompressedImage::decodeBlockRow(int by, uint8_t *rgba, int stride) const
+{
+    for (int bx = 0; bx < resx / 4; ++bx) {
+        const PackedBlock& pb = data[by * (resx / 4) + bx];
+
+        vec3 colors[4];
+        blockPalette(pb, colors);
+        uint32_t palette[4];
+        for (int k = 0; k < 4; ++k) {
+            vec3 c = glm::clamp(colors[k], vec3(0), vec3(255));
+            uint8_t rgba8[4] = { uint8_t(std::round(c.r)), uint8_t(std::round(c.g)), uint8_t(std::round(c.b)), 255 };
+            std::memcpy(&palette[k], rgba8, 4);
+        }
+
+        unsigned char bit[16];
+        for (int i = 0; i < 16; ++i)
+            bit[i] = packedCode(pb, i);
 
-    for (const Block& blk : data) {
-        CompressedBlock qb = encodeBlock(blk);
-        std::memcpy(p, &qb, sizeof(CompressedBlock));
-        p += sizeof(CompressedBlock);
+        for (int h = 0; h < 4; ++h)
+            expandRow(palette, &bit[4 * h], rgba + h * stride + 16 * bx);
     }
-    assert(*bufptr + allocsz == p);
-    return allocsz;
+}
+
+void CompressedImage::decodeBlockRow(int by, vec3 *rgb, int stride) const
+{
+    for (int bx = 0; bx < resx / 4; ++bx) {
+        const PackedBlock& pb = data[by * (resx / 4) + bx];
+
+        vec3 palette[4];
+        blockPalette(pb, palette);
+
+        for (int h = 0; h < 4; ++h)
+            for (int k = 0; k < 4; ++k)
+                rgb[h * stride + 4 * bx + k] = palette[packedCode(pb, 4 * h + k)];
+    }
+}
+
+void CompressedImage::decode(uint8_t *rgba) const
+{
+    parallelFor(resy / 4, [&](int by, int) {
+        decodeBlockRow(by, rgba + size_t(4 * by) * resx * 4, resx * 4);
+    });
+}
+
+void CompressedImage::decode(Image& img) const
+{
+    img.resize(resx, resy);
+    parallelFor(resy / 4, [&](int by, int) {
+        decodeBlockRow(by, &img.pixel(0, 4 * by), resx);
+    });
 }
 
 unsigned CompressedImage::nblk() const
@@ -193,81 +489,69 @@ int CompressedImage::getBlockIndex(int x, int y) const
     return (y/4) * (resx/4) + (x/4);
 }
 
-Block& CompressedImage::getBlock(int x, int y)
+Block CompressedImage::getBlock(int x, int y) const
 {
-    return data[getBlockIndex(x, y)];
+    return unpackBlock(data[getBlockIndex(x, y)]);
 }
 
-const Block& CompressedImage::getBlock(int x, int y) const
+Block CompressedImage::getBlock(int i) const
 {
-    return data[getBlockIndex(x, y)];
+    return unpackBlock(data[i]);
 }
 
-Block& CompressedImage::getBlock(int i)
+void CompressedImage::setBlock(int i, const Block& blk)
 {
-    return data[i];
+    data[i] = packBlock(blk);
+    verbatimBlocks.erase(i);
 }
 
 unsigned char CompressedImage::getMask(int x, int y) const
 {
     x = (x + resx) % resx;
     y = (y + resy) % resy;
-    const Block& blk = getBlock(x, y);
-    return blk.bit[(y % 4) * 4 + (x % 4)];
+    return packedCode(data[getBlockIndex(x, y)], (y % 4) * 4 + (x % 4));
+}
+
+bool CompressedImage::isFixedBlock(int bx, int by) const
+{
+    auto it = verbatimBlocks.find(size_t(by) * (resx / 4) + bx);
+    if (it == verbatimBlocks.end() || it->second.c0 > it->second.c1)
+        return false;
+    for (unsigned i = 0; i < 16; ++i) {
+        if (((it->second.index >> (2 * i)) & 3) == 3)
+            return true;
+    }
+    return false;
 }
 
 void CompressedImage::setBlockColor(int bx, int by, int ci, vec3 c)
 {
     int bi = by * (resx/4) + (bx);
+    uint16_t qc = quantizeColor(glm::clamp(c, vec3(0), vec3(255)));
+    verbatimBlocks.erase(bi);
     if (ci == 0)
-        data[bi].c0 = c;
+        data[bi].c0 = qc;
     else
-        data[bi].c1 = c;
+        data[bi].c1 = qc;
 }
 
 vec3 CompressedImage::pixel(int x, int y) const
 {
-    const Block& blk = getBlock(x, y);
+    const PackedBlock& pb = data[getBlockIndex(x, y)];
     unsigned char bitmask = getMask(x, y);
     vec2 w = getWeights(bitmask);
-    return glm::mix(blk.c0, blk.c1, w.y);
-}
-
-void CompressedImage::quantizeBlocks()
-{
-    for (Block& blk : data) {
-
-        assert(blk.c0.r >= 0 && "pre");
-        assert(blk.c0.g >= 0 && "pre");
-        assert(blk.c0.b >= 0 && "pre");
-        assert(blk.c1.r >= 0 && "pre");
-        assert(blk.c1.g >= 0 && "pre");
-        assert(blk.c1.b >= 0 && "pre");
-
-        uint16_t c0 = quantizeColor(blk.c0);
-        uint16_t c1 = quantizeColor(blk.c1);
-        blk.c0 = quantized2rgb(c0);
-        assert(blk.c0.r >= 0);
-        assert(blk.c0.g >= 0);
-        assert(blk.c0.b >= 0);
-        blk.c1 = quantized2rgb(c1);
-
-        assert(blk.c1.r >= 0);
-        assert(blk.c1.g >= 0);
-        assert(blk.c1.b >= 0);
-
-    }
+    return glm::mix(quantized2rgb(pb.c0), quantized2rgb(pb.c1), w.y);
 }
 
 
 // -- static functions ---------------------------------------------------------
 
 
-static CompressedBlock encodeBlock(const Block& blk)
+static CompressedBlock encodeBlock(const PackedBlock& pb)
 {
     CompressedBlock cb = {0, 0, 0};
-    cb.c0 = quantizeColor(blk.c0);
-    cb.c1 = quantizeColor(blk.c1);
+    cb.c0 = pb.c0;
+    cb.c1 = pb.c1;
 
     bool swapped = false;
     if (cb.c0 < cb.c1) {
@@ -278,51 +562,108 @@ static CompressedBlock encodeBlock(const Block& blk)
     }
 
     for (unsigned i = 0; i < 16; ++i) {
-        uint32_t mask = swapped ? swappedMask(blk.bit[i]) : blk.bit[i];
+        uint32_t mask = swapped ? swappedMask(packedCode(pb, i)) : packedCode(pb, i);
         mask = ((cb.c0 == cb.c1 ? 0 : mask) << (2 * i));
         cb.index |= mask;
     }
     return cb;
 }
 
-static float optimizeEndpoints(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, uint8_t bitmask, Block& blk)
+static PackedBlock packBlock(const Block& blk)
 {
-    std::vector<int> ind;
-    for (unsigned i = 0; i < cblk.size(); ++i)
-        if ((!bitmask) || (mblk[i] & bitmask))
-           ind.push_back(i);
+    PackedBlock pb = {0, 0, 0};
+    pb.c0 = quantizeColor(glm::clamp(blk.c0, vec3(0), vec3(255)));
+    pb.c1 = quantizeColor(glm::clamp(blk.c1, vec3(0), vec3(255)));
+    for (unsigned i = 0; i < 16; ++i)
+        pb.bits |= uint32_t(blk.bit[i]) << (2 * i);
+    return pb;
+}
 
-    Eigen::MatrixXf A(ind.size(), 2);
-    Eigen::MatrixXf B(ind.size(), 3);
+// exact in 4 color mode (c0 > c1); in 3 color mode the midpoint gets the code of 2/3 c0 + 1/3 c1
+// and transparent black that of c0
+static PackedBlock decodeBlock(const CompressedBlock& cb)
+{
+    PackedBlock pb = { cb.c0, cb.c1, cb.index };
+    if (cb.c0 > cb.c1)
+        return pb;
 
-    for (unsigned i = 0; i < ind.size(); ++i) {
-        vec2 w = CompressedImage::getWeights(blk.bit[ind[i]]);
-        A.row(i) = Eigen::Vector2f(w.x, w.y);
-        for (int j = 0; j < 3; ++j)
-            B(i, j) = cblk[ind[i]][j];
+    pb.bits = 0;
+    for (unsigned i = 0; i < 16; ++i) {
+        uint32_t code = (cb.index >> (2 * i)) & 3;
+        if (code == 2)
+            code = QMASK_C0_23_C1_13;
+        else if (code == 3)
+            code = QMASK_C0;
+        pb.bits |= code << (2 * i);
     }
-    Eigen::MatrixXf AtA = A.transpose() * A;
-    Eigen::MatrixXf AtB = A.transpose() * B;
+    return pb;
+}
 
-    float r = 0;
+static Block unpackBlock(const PackedBlock& pb)
+{
+    Block blk;
+    blk.c0 = quantized2rgb(pb.c0);
+    blk.c1 = quantized2rgb(pb.c1);
+    for (unsigned i = 0; i < 16; ++i)
+        blk.bit[i] = packedCode(pb, i);
+    return blk;
+}
 
-    for (int j = 0; j < 3; ++j) {
-        Eigen::Vector2f xj = AtA.ldlt().solve(AtB.col(j));
-        blk.c0[j] = xj[0];
-        blk.c1[j] = xj[1];
+static inline unsigned char packedCode(const PackedBlock& pb, int i)
+{
+    return (pb.bits >> (2 * i)) & 3;
+}
 
-        Eigen::VectorXf rvec = A * xj - B.col(j);
+// refits the endpoints of blk to its bits: the least squares solution over the masked pixels,
+// in closed form from the sums of the 2x2 normal equations. Returns the squared error of the
+// masked pixels with the new (clamped) endpoints
+static float optimizeEndpoints(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, Block& blk)
+{
+    float a00 = 0, a01 = 0, a11 = 0; // sums of w0 w0, w0 w1, w1 w1
+    vec3 b0(0), b1(0);               // sums of w0 c, w1 c
+    vec3 sum(0);
+    vec2 wlast(1, 0);
+    int n = 0;
+    for (int i = 0; i < 16; ++i) {
+        if ((!bitmask) || (mblk[i] & bitmask)) {
+            vec2 w = CompressedImage::getWeights(blk.bit[i]);
+            a00 += w.x * w.x;
+            a01 += w.x * w.y;
+            a11 += w.y * w.y;
+            b0 += w.x * cblk[i];
+            b1 += w.y * cblk[i];
+            sum += cblk[i];
+            wlast = w;
+            n++;
+        }
+    }
 
-        r += rvec.squaredNorm();
+    float det = a00 * a11 - a01 * a01;
+    if (det > 1e-4f * a00 * a11) {
+        blk.c0 = (a11 * b0 - a01 * b1) / det;
+        blk.c1 = (a00 * b1 - a01 * b0) / det;
+    } else if (n > 0) {
+        // the pixels all have the same weights and only that mix of the endpoints is
+        // determined, both endpoints move so that it becomes the mean
+        vec3 delta = sum / float(n) - (wlast.x * blk.c0 + wlast.y * blk.c1);
+        blk.c0 += delta;
+        blk.c1 += delta;
     }
 
     blk.c0 = glm::clamp(blk.c0, vec3(0, 0, 0), vec3(255, 255, 255));
     blk.c1 = glm::clamp(blk.c1, vec3(0, 0, 0), vec3(255, 255, 255));
 
+    float r = 0;
+    for (int i = 0; i < 16; ++i) {
+        if ((!bitmask) || (mblk[i] & bitmask)) {
+            vec3 d = getColor(blk, i) - cblk[i];
+            r += glm::dot(d, d);
+        }
+    }
     return r;
 }
 
-static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line, vec3& c0, vec3& c1)
+static void findColorInterval(const vec3 *cblk, int n, const Line3& line, vec3& c0, vec3& c1)
 {
     //float tmin = std::numeric_limits<float>::max();
     //float tmax = std::numeric_limits<float>::lowest();
@@ -332,7 +673,7 @@ static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line,
     float tmin = 0;
     float tmax = 0;
 
-    for (unsigned i = 0; i < cblk.size(); ++i) {
+    for (int i = 0; i < n; ++i) {
         vec3 cvec = cblk[i] - line.o;
         float t = glm::dot(cvec, line.d);
         tmin = std::min(t, tmin);
@@ -344,37 +685,17 @@ static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line,
 
 static unsigned char getQuantizationMask(const vec3& color, const vec3& c0, const vec3& c1)
 {
-    const float a = 2.0f/3.0f;
-    const float b = 1.0f/3.0f;
-    vec3 c2 = a * c0 + b * c1;
-    vec3 c3 = b * c0 + a * c1;
-
-    float dmin = std::numeric_limits<float>::max();
-    float d;
-    unsigned char mask = 0xff;
-
-    if ((d = distance(color, c0)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0;
-    }
-
-    if ((d = distance(color, c2)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0_23_C1_13;
-    }
+    // the palette colors are evenly spaced on the segment from c0 to c1, so the closest one
+    // is at the nearest third of the projection of color on the segment
+    static const unsigned char masks[4] = { QMASK_C0, QMASK_C0_23_C1_13, QMASK_C0_13_C1_23, QMASK_C1 };
 
-    if ((d = distance(color, c3)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0_13_C1_23;
-    }
-
-    if ((d = distance(color, c1)) < dmin) {
-        dmin = d;
-        mask = QMASK_C1;
-    }
-    assert(mask != 0xff);
+    vec3 d = c1 - c0;
+    float len2 = glm::dot(d, d);
+    if (len2 <= 0)
+        return QMASK_C0;
 
-    return mask;
+    float t = glm::clamp(3.0f * glm::dot(color - c0, d) / len2, 0.0f, 3.0f);
+    return masks[int(std::ceil(t - 0.5f))]; // ties go to the entry closer to c0
 }
 
 static unsigned char swappedMask(unsigned char mask)
@@ -393,49 +714,58 @@ static unsigned char swappedMask(unsigned char mask)
     }
 }
 
-// cblk is a 4x4 block of pixels stored by row
-static Block computeBlock(const std::vector<vec3>& cblk, const std::vector<uint8_t> &mblk, uint8_t bitmask)
+// the 4x4 block (bx, by) of img, by row
+static void loadBlock(const Image& img, int bx, int by, vec3 *cblk, uint8_t *mblk)
+{
+    for (int h = 0; h < 4; ++h)
+    for (int k = 0; k < 4; ++k) {
+        cblk[4 * h + k] = img.pixel(4 * bx + k, 4 * by + h);
+        mblk[4 * h + k] = img.mask(4 * bx + k, 4 * by + h);
+    }
+}
+
+// cblk and mblk are the 16 pixels of a 4x4 block stored by row
+static Block computeBlock(const vec3 *cblk, const uint8_t *mblk, uint8_t bitmask, int refinements)
 {
     Block blk;
 
-    std::vector<vec3> cblkPosWeight;
-    assert(mblk.size() == 16);
-    for (unsigned i = 0; i < mblk.size(); ++i)
+    vec3 cblkPosWeight[16];
+    int npos = 0;
+    for (int i = 0; i < 16; ++i)
         if ((!bitmask) || (mblk[i] & bitmask))
-            cblkPosWeight.push_back(cblk[i]);
+            cblkPosWeight[npos++] = cblk[i];
 
-    if (cblkPosWeight.size() == 0)
-        //cblkPosWeight.push_back(cblk.front());
-        cblkPosWeight.push_back(vec3(0, 0, 0));
+    if (npos == 0)
+        //cblkPosWeight[npos++] = cblk[0];
+        cblkPosWeight[npos++] = vec3(0, 0, 0);
 
-    Line3 line = fitLine(cblkPosWeight);
-    findColorInterval(cblkPosWeight, line, blk.c0, blk.c1);
+    Line3 line = fitLine(cblkPosWeight, npos);
+    findColorInterval(cblkPosWeight, npos, line, blk.c0, blk.c1);
 
     for (unsigned i = 0; i < 16; ++i) {
         blk.bit[i] = getQuantizationMask(cblk[i], blk.c0, blk.c1);
     }
 
-    if (cblkPosWeight.size() > 2)
-        optimizeEndpoints(cblk, mblk, bitmask, blk);
-
-#if 0
-    // iterative version
-    if (cblkPosWeight.size() > 2) {
-        float rmin = std::numeric_limits<float>::max();
-        while (true) {
-            k++;
-            float r = optimizeEndpoints(cblk, mblk, bitmask, blk);
-            if (r >= rmin) {
-                break;
-            } else {
-                rmin = r;
-                for (unsigned i = 0; i < 16; ++i) {
-                    blk.bit[i] = getQuantizationMask(cblk[i], blk.c0, blk.c1);
-                }
+    // the endpoints are refitted to the bits, then the pixels get the closest color of the new
+    // endpoints and so on, while the error goes down
+    if (npos > 2) {
+        float rmin = optimizeEndpoints(cblk, mblk, bitmask, blk);
+        for (int it = 0; it < refinements; ++it) {
+            Block next = blk;
+            bool changed = false;
+            for (unsigned i = 0; i < 16; ++i) {
+                next.bit[i] = getQuantizationMask(cblk[i], next.c0, next.c1);
+                changed = changed || (next.bit[i] != blk.bit[i]);
             }
+            if (!changed) // the same bits give the same endpoints
+                break;
+            float r = optimizeEndpoints(cblk, mblk, bitmask, next);
+            if (r >= rmin)
+                break;
+            rmin = r;
+            blk = next;
         }
     }
-#endif
 
     return blk;
 }
@@ -448,18 +778,6 @@ static vec3 getColor(const Block& blk, int i)
     return glm::mix(blk.c0, blk.c1, w.y);
 }
 
-static uint16_t quantizeColor_(const vec3& color)
-{
-    vec3 qc = (color / vec3(256.0f)) * vec3(32.0f, 64.0f, 32.0f);
-    qc = glm::clamp(qc, vec3(0), vec3(31.0f, 63.0f, 31.0f));
-
-    uint16_t c = 0;
-    c |= (uint16_t(qc.x) << 11);
-    c |= (uint16_t(qc.y) << 5);
-    c |= uint16_t(qc.z);
-    return c;
-}
-
 static uint16_t quantizeColor(const vec3& color)
 {
     uint16_t r16 = std::round(color.r);
@@ -4,6 +4,7 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
+#include <map>
 #include <vector>
 
 class Image;
@@ -50,6 +51,14 @@ typedef struct __attribute__ ((packed)) {
     uint32_t index;
 } CompressedBlock;
 
+// how CompressedImage stores a block: the endpoints quantized to 5:6:5 as in CompressedBlock,
+// but in encoder order, and the code of pixel i (QMASK_*) in bits 2i, 2i+1 of bits
+struct PackedBlock {
+    uint16_t c0;
+    uint16_t c1;
+    uint32_t bits;
+};
+
 const unsigned char QMASK_C0 = 0;
 const unsigned char QMASK_C0_23_C1_13 = 2;
 const unsigned char QMASK_C0_13_C1_23 = 3;
@@ -77,39 +86,84 @@ private:
 
 public:
 
-    std::vector<Block> data;
+    std::vector<PackedBlock> data;
+
+    // the levels after the first of the DDS mip chain, each half the size of the previous one
+    std::vector<std::vector<PackedBlock>> mipmaps;
+
+    // the blocks read from a DDS file that PackedBlock cannot represent exactly (3 color mode,
+    // c0 <= c1), by index in the file; they are written back as read until set again
+    std::map<size_t, CompressedBlock> verbatimBlocks;
 
     CompressedImage() {}
 
     int resx;
     int resy;
 
-    void initialize(const Image& img, uint8_t bitmask);
+    // rounds of refitting the endpoints and reassigning the pixels after the first fit, used by
+    // initialize() and generateMipmaps(). On a noisy texture 2 rounds lower the rms error by
+    // about 0.6% and take 25-40% more time, so by default the endpoints are fitted once
+    int endpointRefinements = 0;
+
+    // batched encodes 8 blocks at a time with computeBlocks8() (block_batch.h), in single precision
+    void initialize(const Image& img, uint8_t bitmask, bool batched = false);
     std::vector<BlockErrorData> computePerBlockError(const Image& img) const;
 
-    /* (virtual) 16 bit quantization of block colors */
-    void quantizeBlocks();
+    // blocks per second and error of the scalar and the batched encoder on img
+    static void benchmarkEncoders(const Image& img, uint8_t bitmask, int refinements = 0);
 
+    // encodes the mip levels from img, halved by a box filter, up to levels levels in total or
+    // while the sizes are multiples of 4 (0: all of them). Every pixel counts, masks or not
+    void generateMipmaps(const Image& img, int levels = 0, bool batched = false);
+    int mipLevels() const;
+
+    // the DDS file: magic, header and the blocks of every level. writeDDS() fills buf, of
+    // ddsSize() bytes, encoding the block rows in parallel
+    size_t ddsSize() const;
+    void writeDDS(uint8_t *buf) const;
+
+    // save() maps the file in memory and writes it with writeDDS() where mmap() is available
     void save(const char *filename) const;
+
+    // reads a DXT1 DDS file with sizes multiple of 4, with the mip levels that are too; the 3 color
+    // blocks get the closest codes of the 4 color mode: midpoint as 2/3 c0 + 1/3 c1, black as c0.
+    // Those with black texels are fixed, see isFixedBlock()
+    bool read(const uint8_t *buf, size_t size);
+    bool load(const char *filename);
     bool saveUncompressed(const char *path) const;
 
+    // allocates *bufptr with new[]
     int write(uint8_t **bufptr) const;
 
 #ifdef __EMSCRIPTEN__
     void writeAsRGB(uint8_t *imgbuf) const;
 #endif
 
+    // decodes the 4 pixel rows of block row by into resx pixels per row, stride apart: RGBA8
+    // rounded as Image::save() (stride in bytes), or the colors of pixel() (stride in pixels)
+    void decodeBlockRow(int by, uint8_t *rgba, int stride) const;
+    void decodeBlockRow(int by, glm::vec3 *rgb, int stride) const;
+
+    // all the block rows, in parallel: rgba holds resx * resy * 4 bytes, img is resized
+    void decode(uint8_t *rgba) const;
+    void decode(Image& img) const;
+
     unsigned nblk() const;
     int getBlockIndex(int x, int y) const;
 
-    Block& getBlock(int x, int y);
-    Block& getBlock(int i);
-
-    const Block& getBlock(int x, int y) const;
+    // the blocks with their quantized endpoints; setBlock() quantizes them
+    Block getBlock(int x, int y) const;
+    Block getBlock(int i) const;
+    void setBlock(int i, const Block& blk);
 
     unsigned char getMask(int x, int y) const;
 
-    void setBlockColor(int x, int y, int ci, glm::vec3 c);
+    // a block read in 3 color mode with black texels, transparent with 1 bit alpha: no 4 color
+    // block keeps them, so it stays as read and the seam solver takes its texels as constants
+    bool isFixedBlock(int bx, int by) const;
+
+    // endpoint ci of block (bx, by), quantized
+    void setBlockColor(int bx, int by, int ci, glm::vec3 c);
     glm::vec3 pixel(int x, int y) const;
 
 
@@ -3,6 +3,8 @@
 #include "mesh.h"
 #include "image.h"
 #include "solver.h"
+#include "factorization_cache.h"
+#include "parallel.h"
 
 #include <glm/common.hpp>
 
@@ -35,16 +37,7 @@ void Image::write(uint8_t *imgbuf)
 
 void CompressedImage::writeAsRGB(uint8_t *imgbuf) const
 {
-    int nc = 4;
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        int k = (y * resx + x) * nc;
-        vec3 p = pixel(x, y);
-        imgbuf[k] = uint8_t(glm::clamp(p.x, 0.0f, 255.0f));
-        imgbuf[k+1] = uint8_t(glm::clamp(p.y, 0.0f, 255.0f));
-        imgbuf[k+2] = uint8_t(glm::clamp(p.z, 0.0f, 255.0f));
-        imgbuf[k+3] = 255;
-    }
+    decode(imgbuf);
 }
 
 struct ProcessingInterface {
@@ -61,6 +54,13 @@ struct ProcessingInterface {
     int csz;
     uint8_t *compressedbuf;
 
+    SolverBackend backend;
+    SeamSampleSet::Mode seamSampling;
+    bool parallelProducts;
+    int mipLevels;
+
+    FactorizationCache cache; // in memory, smoothing again with the same mesh skips the factorization
+
     ProcessingInterface();
 
     void allocateImageBuffers(int w, int h);
@@ -70,7 +70,13 @@ struct ProcessingInterface {
     emscripten::val getCompressedBuf();
 
     void loadMesh(const std::string& path);
+    bool setSolver(const std::string& name);
+    void setIntegratedSeams(bool integrated);
+    void setThreadCount(int n);
+    void setParallelProducts(bool enable);
+    void setMipLevels(int levels);
 
+    void writeCompressed(const CompressedImage& cimg);
     void compress();
     void smooth(double alpha);
     void compressAndSmooth(double alpha);
@@ -113,7 +119,9 @@ intptr_t ProcessingInterface::getUVBufferMirrorV()
 }
 
 ProcessingInterface::ProcessingInterface()
-    : m(), resx(0), resy(0), isz(0), imgbuf(nullptr), outputbuf(nullptr), csz(0), compressedbuf(nullptr)
+    : m(), resx(0), resy(0), isz(0), imgbuf(nullptr), outputbuf(nullptr), csz(0), compressedbuf(nullptr),
+      backend(SolverBackend::LDLT_AMD), seamSampling(SeamSampleSet::Mode::Point), parallelProducts(false),
+      mipLevels(1)
 {
 }
 
@@ -168,19 +176,63 @@ void ProcessingInterface::loadMesh(const std::string& path)
     m.mirrorV();
 }
 
+bool ProcessingInterface::setSolver(const std::string& name)
+{
+    return parseSolverBackend(name, backend);
+}
+
+void ProcessingInterface::setIntegratedSeams(bool integrated)
+{
+    seamSampling = integrated ? SeamSampleSet::Mode::Integrated : SeamSampleSet::Mode::Point;
+}
+
+// only a build with -s USE_PTHREADS=1 gets more than one thread, see parallel.cpp
+void ProcessingInterface::setThreadCount(int n)
+{
+    ::setThreadCount(n);
+}
+
+void ProcessingInterface::setParallelProducts(bool enable)
+{
+    parallelProducts = enable;
+}
+
+// levels of the mip chain of the compressed texture, 0 for all of them
+void ProcessingInterface::setMipLevels(int levels)
+{
+    mipLevels = levels;
+}
+
 void ProcessingInterface::smooth(double alpha)
 {
     Image img;
     img.read(imgbuf, resx, resy);
 
+    SeamSampleSet samples(m, resx, resy, seamSampling);
+
     unsigned ni = img.setMaskInternal(m);
-    unsigned ns = img.setMaskSeam(m);
+    unsigned ns = img.setMaskSeam(samples);
 
-    Solver().fixSeamsSeparateChannels(m, img, alpha);
+    Solver solver(backend);
+    solver.setFactorizationCache(&cache);
+    solver.setParallelProducts(parallelProducts);
+    solver.fixSeamsSeparateChannels(samples, img, alpha);
 
     img.write(outputbuf);
 }
 
+// the DDS file goes to compressedbuf, reallocated only when its size changes
+void ProcessingInterface::writeCompressed(const CompressedImage& cimg)
+{
+    int size = cimg.ddsSize();
+    if (!compressedbuf || size != csz) {
+        delete [] compressedbuf;
+        compressedbuf = new uint8_t[size];
+        csz = size;
+    }
+    cimg.writeDDS(compressedbuf);
+}
+
 void ProcessingInterface::compress()
 {
     CompressedImage cimg;
@@ -191,9 +243,9 @@ void ProcessingInterface::compress()
     unsigned ns = img.setMaskSeam(m);
 
     cimg.initialize(img, Image::MaskBit::Internal | Image::MaskBit::Seam);
-    cimg.quantizeBlocks();
+    cimg.generateMipmaps(img, mipLevels);
 
-    csz = cimg.write(&compressedbuf);
+    writeCompressed(cimg);
     cimg.writeAsRGB(outputbuf);
 }
 
@@ -203,15 +255,19 @@ void ProcessingInterface::compressAndSmooth(double alpha)
 
     Image seamless;
     seamless.read(outputbuf, resx, resy);
+    SeamSampleSet samples(m, resx, resy, seamSampling);
+
     unsigned ni = seamless.setMaskInternal(m);
-    unsigned ns = seamless.setMaskSeam(m);
+    unsigned ns = seamless.setMaskSeam(samples);
 
     CompressedImage cimg;
     cimg.initialize(seamless, Image::MaskBit::Internal | Image::MaskBit::Seam);
-    SolverCompressedImage().fixSeamsSeparateChannels(m, seamless, cimg, alpha);
-    cimg.quantizeBlocks();
+    SolverCompressedImage csolver(backend);
+    csolver.setParallelProducts(parallelProducts);
+    csolver.fixSeamsSeparateChannels(samples, seamless, cimg, alpha);
+    cimg.generateMipmaps(seamless, mipLevels);
 
-    csz = cimg.write(&compressedbuf);
+    writeCompressed(cimg);
     cimg.writeAsRGB(outputbuf);
 }
 
@@ -223,6 +279,11 @@ EMSCRIPTEN_BINDINGS(processing_interface) {
         .function("getOutputBuf"        , &ProcessingInterface::getOutputBuf)
         .function("getCompressedBuf"    , &ProcessingInterface::getCompressedBuf)
         .function("loadMesh"            , &ProcessingInterface::loadMesh)
+        .function("setSolver"           , &ProcessingInterface::setSolver)
+        .function("setIntegratedSeams"  , &ProcessingInterface::setIntegratedSeams)
+        .function("setThreadCount"      , &ProcessingInterface::setThreadCount)
+        .function("setParallelProducts" , &ProcessingInterface::setParallelProducts)
+        .function("setMipLevels"        , &ProcessingInterface::setMipLevels)
         .function("compress"            , &ProcessingInterface::compress)
         .function("smooth"              , &ProcessingInterface::smooth)
         .function("compressAndSmooth"   , &ProcessingInterface::compressAndSmooth)
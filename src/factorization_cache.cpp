@@ -0,0 +1,239 @@
+#include "factorization_cache.h"
+#include "image.h"
+#include "seam_sample_set.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace Eigen;
+
+// -- LDLTFactors --------------------------------------------------------------
+
+void LDLTFactors::solveInPlace(MatrixXd& b) const
+{
+    // same steps as SimplicialLDLT::solve()
+    b = P * b;
+    L.triangularView<UnitLower>().solveInPlace(b);
+    b = D.asDiagonal().inverse() * b;
+    L.transpose().triangularView<UnitUpper>().solveInPlace(b);
+    b = P.transpose() * b;
+}
+
+template <typename T>
+static void writeArray(std::ostream& out, const T *data, int64_t n)
+{
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    out.write(reinterpret_cast<const char *>(data), n * sizeof(T));
+}
+
+template <typename T>
+static bool readValue(std::istream& in, int64_t& left, T& value)
+{
+    if (left < int64_t(sizeof(T)))
+        return false;
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+    left -= sizeof(T);
+    return bool(in);
+}
+
+// a corrupt size cannot allocate more than the left bytes of the file
+template <typename T>
+static bool readArray(std::istream& in, int64_t& left, std::vector<T>& v)
+{
+    int64_t n = -1;
+    if (!readValue(in, left, n) || n < 0 || n > left / int64_t(sizeof(T)))
+        return false;
+    v.resize(n);
+    in.read(reinterpret_cast<char *>(v.data()), n * sizeof(T));
+    left -= n * sizeof(T);
+    return bool(in);
+}
+
+void LDLTFactors::write(std::ostream& out) const
+{
+    SparseMatrix<double> Lc = L;
+    Lc.makeCompressed();
+    int64_t n = Lc.cols();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    writeArray(out, Lc.outerIndexPtr(), n + 1);
+    writeArray(out, Lc.innerIndexPtr(), Lc.nonZeros());
+    writeArray(out, Lc.valuePtr(), Lc.nonZeros());
+    writeArray(out, D.data(), D.size());
+    writeArray(out, P.indices().data(), P.indices().size());
+}
+
+bool LDLTFactors::read(std::istream& in, int64_t& left)
+{
+    int64_t n = -1;
+    if (!readValue(in, left, n) || n < 0)
+        return false;
+
+    std::vector<int> outer, inner, perm;
+    std::vector<double> values, diag;
+    if (!readArray(in, left, outer) || !readArray(in, left, inner) || !readArray(in, left, values) || !readArray(in, left, diag) || !readArray(in, left, perm))
+        return false;
+    if (int64_t(outer.size()) != n + 1 || inner.size() != values.size() || int64_t(diag.size()) != n || int64_t(perm.size()) != n)
+        return false;
+
+    // L is strictly lower triangular by column and P a permutation
+    if (outer[0] != 0 || outer[n] != int(inner.size()))
+        return false;
+    for (int64_t j = 0; j < n; ++j) {
+        if (outer[j] > outer[j+1])
+            return false;
+        for (int k = outer[j]; k < outer[j+1]; ++k) {
+            if (inner[k] <= j || inner[k] >= n)
+                return false;
+        }
+    }
+    std::vector<bool> seen(n, false);
+    for (int i : perm) {
+        if (i < 0 || i >= n || seen[i])
+            return false;
+        seen[i] = true;
+    }
+
+    L = Map<const SparseMatrix<double>>(n, n, inner.size(), outer.data(), inner.data(), values.data());
+    D = Map<const VectorXd>(diag.data(), n);
+    P.indices() = Map<const VectorXi>(perm.data(), n);
+    return true;
+}
+
+
+// -- FactorizationCache -------------------------------------------------------
+
+// followed by resx, resy (int32), alpha (double) and the number of variables (int64)
+static const char cacheMagic[8] = { 'S', 'E', 'A', 'M', 'L', 'D', 'L', '2' };
+
+FactorizationCache::FactorizationCache(const std::string& directory)
+    : dir{directory}
+{
+}
+
+// FNV-1a
+static void hashBytes(uint64_t& h, const void *data, size_t n)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+}
+
+template <typename T>
+static void hashVector(uint64_t& h, const std::vector<T>& v)
+{
+    hashBytes(h, v.data(), v.size() * sizeof(T));
+}
+
+uint64_t FactorizationCache::key(const SeamSampleSet& samples, const Image& img, double alpha)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    hashBytes(h, &samples.resx, sizeof(samples.resx));
+    hashBytes(h, &samples.resy, sizeof(samples.resy));
+    hashBytes(h, &alpha, sizeof(alpha));
+
+    // the samples follow from Mesh::vtvec, Mesh::seam, the resolution and the sampling mode
+    hashVector(h, samples.seamBegin);
+    for (int side = 0; side < 2; ++side) {
+        for (int corner = 0; corner < 4; ++corner)
+            hashVector(h, samples.pixel[side][corner]);
+        hashVector(h, samples.wx[side]);
+        hashVector(h, samples.wy[side]);
+    }
+    hashVector(h, samples.weight);
+
+    // the identity weights depend on which of the sampled pixels are internal
+    for (int side = 0; side < 2; ++side) {
+        for (int corner = 0; corner < 4; ++corner) {
+            for (int k = 0; k < samples.size(); ++k) {
+                uint8_t internal = img.mask(samples.pixelX(side, corner, k), samples.pixelY(side, corner, k)) & Image::MaskBit::Internal;
+                hashBytes(h, &internal, 1);
+            }
+        }
+    }
+
+    return h;
+}
+
+std::string FactorizationCache::pathOf(uint64_t key) const
+{
+    std::ostringstream path;
+    path << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".ldlt";
+    return path.str();
+}
+
+std::shared_ptr<const CachedSeamSystem> FactorizationCache::find(uint64_t key, int resx, int resy, double alpha)
+{
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        const CachedSeamSystem& entry = *it->second;
+        if (entry.resx != resx || entry.resy != resy || entry.alpha != alpha)
+            return nullptr;
+        return it->second;
+    }
+
+    if (dir.empty())
+        return nullptr;
+
+    std::ifstream in(pathOf(key), std::ios::binary | std::ios::ate);
+    if (!in)
+        return nullptr;
+    int64_t left = in.tellg();
+    in.seekg(0);
+
+    std::shared_ptr<CachedSeamSystem> entry = std::make_shared<CachedSeamSystem>();
+    char magic[sizeof(cacheMagic)];
+    int32_t fileResx = 0, fileResy = 0;
+    int64_t nvar = -1;
+    bool valid = left >= int64_t(sizeof(magic)) && in.read(magic, sizeof(magic)) && std::memcmp(magic, cacheMagic, sizeof(magic)) == 0;
+    left -= sizeof(magic);
+    valid = valid && readValue(in, left, fileResx) && readValue(in, left, fileResy) && readValue(in, left, entry->alpha) && readValue(in, left, nvar);
+    valid = valid && readArray(in, left, entry->pixels) && readArray(in, left, entry->idWeight) && entry->factors.read(in, left);
+    valid = valid && int64_t(entry->pixels.size()) == nvar && int64_t(entry->idWeight.size()) == nvar && entry->factors.D.size() == nvar;
+    for (unsigned v = 0; valid && v < entry->pixels.size(); ++v)
+        valid = entry->pixels[v] >= 0 && int64_t(entry->pixels[v]) < int64_t(fileResx) * fileResy;
+    if (!valid) {
+        std::cerr << "Warning: ignoring " << pathOf(key) << ", it is not a complete factorization" << std::endl;
+        return nullptr;
+    }
+
+    entry->resx = fileResx;
+    entry->resy = fileResy;
+    if (entry->resx != resx || entry->resy != resy || entry->alpha != alpha) {
+        std::cerr << "Warning: ignoring " << pathOf(key) << ", it was made for another texture size or alpha" << std::endl;
+        return nullptr;
+    }
+
+    entries[key] = entry;
+    return entry;
+}
+
+void FactorizationCache::insert(uint64_t key, std::shared_ptr<const CachedSeamSystem> entry)
+{
+    entries[key] = entry;
+
+    if (dir.empty())
+        return;
+
+    std::ofstream out(pathOf(key), std::ios::binary);
+    if (!out) {
+        std::cerr << "Warning: could not write " << pathOf(key) << std::endl;
+        return;
+    }
+    int32_t resx = entry->resx;
+    int32_t resy = entry->resy;
+    int64_t nvar = entry->pixels.size();
+    out.write(cacheMagic, sizeof(cacheMagic));
+    out.write(reinterpret_cast<const char *>(&resx), sizeof(resx));
+    out.write(reinterpret_cast<const char *>(&resy), sizeof(resy));
+    out.write(reinterpret_cast<const char *>(&entry->alpha), sizeof(entry->alpha));
+    out.write(reinterpret_cast<const char *>(&nvar), sizeof(nvar));
+    writeArray(out, entry->pixels.data(), entry->pixels.size());
+    writeArray(out, entry->idWeight.data(), entry->idWeight.size());
+    entry->factors.write(out);
+}
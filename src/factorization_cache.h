@@ -0,0 +1,65 @@
+#ifndef FACTORIZATION_CACHE_H
+#define FACTORIZATION_CACHE_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Sparse>
+
+class Image;
+class SeamSampleSet;
+
+// A^T A = P^T L D L^T P as computed by SimplicialLDLT
+struct LDLTFactors {
+    Eigen::SparseMatrix<double> L; // unit lower triangular, the diagonal is not stored
+    Eigen::VectorXd D;
+    Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> P;
+
+    // overwrites each column of b with the solution of A^T A x = b
+    void solveInPlace(Eigen::MatrixXd& b) const;
+
+    // read() fails on arrays longer than the left bytes of the file and on factors that are not
+    // well formed, left is decreased by the bytes read
+    void write(std::ostream& out) const;
+    bool read(std::istream& in, int64_t& left);
+};
+
+// What Solver::fixSeamsSeparateChannels() needs to solve for a new texture on the same
+// seams: the unknown pixels, the weights of their identity equations and the factors.
+struct CachedSeamSystem {
+    int resx = 0;                 // of the texture
+    int resy = 0;
+    double alpha = 0;             // of the solve
+    std::vector<int> pixels;      // y * resx + x of each variable
+    std::vector<double> idWeight; // squared weight of the identity equation of each variable
+    LDLTFactors factors;
+};
+
+// Factorizations of the seam system, in memory and, if a directory is given, on disk.
+// The system does not depend on the pixel values, only on the seam samples, the
+// internal pixel mask and alpha, which make up the key.
+class FactorizationCache
+{
+    std::string dir;
+    std::map<uint64_t, std::shared_ptr<const CachedSeamSystem>> entries;
+
+    std::string pathOf(uint64_t key) const;
+
+public:
+
+    explicit FactorizationCache(const std::string& directory = std::string());
+
+    static uint64_t key(const SeamSampleSet& samples, const Image& img, double alpha);
+
+    // nullptr if the key is neither in memory nor on disk, or if its entry was made for another
+    // resolution or alpha. Files that do not read back whole are ignored with a warning
+    std::shared_ptr<const CachedSeamSystem> find(uint64_t key, int resx, int resy, double alpha);
+
+    void insert(uint64_t key, std::shared_ptr<const CachedSeamSystem> entry);
+};
+
+#endif // FACTORIZATION_CACHE_H
@@ -1,6 +1,7 @@
 #include "image.h"
 #include "mesh.h"
 #include "sampling.h"
+#include "seam_sample_set.h"
 
 #include <cmath>
 #include <cassert>
@@ -133,32 +134,22 @@ unsigned Image::setMaskInternal(const Mesh& m)
 
 unsigned Image::setMaskSeam(const Mesh& m)
 {
-    using ::Seam;
+    return setMaskSeam(SeamSampleSet(m, resx, resy));
+}
+
+unsigned Image::setMaskSeam(const SeamSampleSet& samples)
+{
+    assert(samples.resx == resx && samples.resy == resy);
 
     unsigned n = 0;
-    vec2 uvscale(resx, resy);
-    for (const Seam& s : m.seam) {
-        double d = m.maxLength(s, uvscale);
-        for (double t = 0; t <= 1; t += 1 / (SEAM_SAMPLING_FACTOR*d)) {
-            vec3 p[8];
-            fetchIndex(m.uvpos(s.first, t) * uvscale, p[0], p[1], p[2], p[3]);
-            fetchIndex(m.uvpos(s.second, t) * uvscale, p[4], p[5], p[6], p[7]);
-            for (int i = 0; i < 8; ++i) {
-                //mask[indexOf(int(p[i].x), int(p[i].y))] = std::max(mask[indexOf(int(p[i].x), int(p[i].y))], p[i].z);
-                int px = int(p[i].x);
-                int py = int(p[i].y);
-                if (!(mask(px, py) & MaskBit::Seam)) {
-                    mask(px, py) |= MaskBit::Seam;
+    for (int side = 0; side < 2; ++side) {
+        for (int corner = 0; corner < 4; ++corner) {
+            for (int i : samples.pixel[side][corner]) {
+                if (!(mask_[i] & MaskBit::Seam)) {
+                    mask_[i] |= MaskBit::Seam;
                     n++;
                 }
             }
-            /*
-            fetchIndex(m.uvpos(s.second, t) * uvscale, p[0], p[1], p[2], p[3]);
-            for (int i = 0; i < 4; ++i) {
-                //mask[indexOf(int(p[i].x), int(p[i].y))] = std::max(mask[indexOf(int(p[i].x), int(p[i].y))], p[i].z);
-                mask(int(p[i].x), int(p[i].y)) = MaskBit::Seam;
-            }
-            */
         }
     }
     return n;
@@ -7,6 +7,7 @@
 #include <glm/vec2.hpp>
 
 struct Mesh;
+class SeamSampleSet;
 
 class Image
 {
@@ -80,6 +81,7 @@ public:
     void clearMask();
     unsigned setMaskInternal(const Mesh& m);
     unsigned setMaskSeam(const Mesh& m);
+    unsigned setMaskSeam(const SeamSampleSet& samples);
 
 };
 
@@ -4,6 +4,7 @@
 
 #include "image.h"
 #include "compressed_image.h"
+#include "parallel.h"
 
 vec3 rgb2vec3(QColor rgb)
 {
@@ -70,10 +71,10 @@ bool CompressedImage::saveUncompressed(const char *path) const
 {
     QImage img(resx, resy, QImage::Format_RGBA8888);
 
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        img.setPixel(x, y, vec3toRgb(pixel(x, y)));
-    }
+    // the rows of Format_RGBA8888 are R, G, B, A bytes
+    parallelFor(resy / 4, [&](int by) {
+        decodeBlockRow(by, img.scanLine(4 * by), img.bytesPerLine());
+    });
 
     return img.save(path);
 }
@@ -12,12 +12,16 @@ INCLUDEPATH += ./eigenlib
 
 LIBS += -lsquish
 
-DEFINES += SOLVER_USE_FACTORIZATION
+# parallel.cpp runs the independent solves on a thread pool
+QMAKE_CXXFLAGS += -pthread
+LIBS += -pthread
 
 SOURCES += \
+        block_batch.cpp \
         block_partitioner.cpp \
         compress_squish.cpp \
         compressed_image.cpp \
+        factorization_cache.cpp \
         image.cpp \
         image_io.cpp \
         line.cpp \
@@ -25,18 +29,28 @@ SOURCES += \
         main.cpp \
         mesh.cpp \
         mesh_io.cpp \
+        parallel.cpp \
+        seam_sample_set.cpp \
+        seam_stencil.cpp \
         solver.cpp \
         emscripten.cpp
 
 HEADERS += \
+    block_batch.h \
     block_partitioner.h \
     compress_squish.h \
     compressed_image.h \
+    factorization_cache.h \
     image.h \
     line.h \
     lineareq.h \
     mesh.h \
     metric.h \
+    parallel.h \
+    quantized_cg.h \
     sampling.h \
+    seam_sample_set.h \
+    seam_stencil.h \
     solver.h \
+    variable_map.h \
     vec3.h
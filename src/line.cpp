@@ -13,27 +13,10 @@ void Line3::normalize()
     d = glm::normalize(d);
 }
 
-Line3 fitLine(const std::vector<vec3>& points)
+// X holds the points by row
+template <typename MatrixType>
+static Line3 principalComponent(MatrixType& X)
 {
-    assert(points.size() > 0);
-
-    if (points.size() == 1) {
-        return Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
-    } else if (points.size() == 2) {
-        float d = glm::distance(points[1], points[0]);
-        if (d > 0)
-            return Line3(glm::mix(points[0], points[1], 0.5), glm::normalize(points[1] - points[0]));
-        else
-            return Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
-    }
-
-    assert(points.size() > 2);
-
-    Eigen::MatrixXd X(points.size(), 3);
-    for (unsigned i = 0; i < points.size(); ++i)
-        X.row(i) = Eigen::Vector3d(points[i].x, points[i].y, points[i].z);
-
-
     Eigen::Vector3d c = X.colwise().mean();
     X.rowwise() -= c.transpose();
 
@@ -46,8 +29,7 @@ Line3 fitLine(const std::vector<vec3>& points)
 
     int k;
     es.eigenvalues().maxCoeff(&k);
-    Eigen::VectorXd p = es.eigenvalues();
-    Eigen::VectorXd pc = es.eigenvectors().col(k);
+    Eigen::Vector3d pc = es.eigenvectors().col(k);
 
     Line3 l(vec3(c.x(), c.y(), c.z()), vec3(pc.x(), pc.y(), pc.z()));
 
@@ -63,3 +45,51 @@ Line3 fitLine(const std::vector<vec3>& points)
 
     return l;
 }
+
+// the lines through 1 or 2 points, false if there are more
+static bool fitLineFew(const vec3 *points, int n, Line3& l)
+{
+    assert(n > 0);
+
+    if (n == 1) {
+        l = Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
+        return true;
+    } else if (n == 2) {
+        float d = glm::distance(points[1], points[0]);
+        if (d > 0)
+            l = Line3(glm::mix(points[0], points[1], 0.5), glm::normalize(points[1] - points[0]));
+        else
+            l = Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
+        return true;
+    }
+    return false;
+}
+
+Line3 fitLine(const std::vector<vec3>& points)
+{
+    Line3 l(vec3(0), vec3(1, 0, 0));
+    if (fitLineFew(points.data(), points.size(), l))
+        return l;
+
+    Eigen::MatrixXd X(points.size(), 3);
+    for (unsigned i = 0; i < points.size(); ++i)
+        X.row(i) = Eigen::Vector3d(points[i].x, points[i].y, points[i].z);
+
+    return principalComponent(X);
+}
+
+Line3 fitLine(const vec3 *points, int n)
+{
+    assert(n <= 16);
+
+    Line3 l(vec3(0), vec3(1, 0, 0));
+    if (fitLineFew(points, n, l))
+        return l;
+
+    // on the stack, the products run as with a MatrixXd
+    Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::ColMajor, 16, 3> X(n, 3);
+    for (int i = 0; i < n; ++i)
+        X.row(i) = Eigen::Vector3d(points[i].x, points[i].y, points[i].z);
+
+    return principalComponent(X);
+}
@@ -39,4 +39,7 @@ struct Line3
 /* Returns the normalized best fitting line (computed using PCA) */
 Line3 fitLine(const std::vector<vec3>& points);
 
+/* Same, for up to 16 points (a 4x4 block) without allocating */
+Line3 fitLine(const vec3 *points, int n);
+
 #endif // LINE_H
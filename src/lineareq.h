@@ -3,18 +3,148 @@
 
 #endif // LINEAREQ_H
 
+#include <algorithm>
 #include <iostream>
-#include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "vec3.h"
 
 
 
+// The terms of a linear expression, as (i, a[i]) pairs sorted by i.
+// Up to inlineCapacity terms are stored in place, which covers the bilinear
+// stencils on both sides of a seam sample; longer expressions spill to the heap.
+class LinearTerms{
+public:
+    struct Term{
+        int first;     // i
+        scalar second; // a[i]
+    };
+
+    static const int inlineCapacity = 16;
+
+private:
+    Term small[inlineCapacity];
+    std::vector<Term> large; // used instead of small when non-empty
+    int n;
+
+    Term* data() { return large.empty() ? small : large.data(); }
+    const Term* data() const { return large.empty() ? small : large.data(); }
+
+    void assign(const Term* t, int count){
+        if (count <= inlineCapacity) {
+            std::copy(t, t + count, small);
+            large.clear();
+        } else {
+            large.assign(t, t + count);
+        }
+        n = count;
+    }
+
+public:
+    LinearTerms() : n(0) {}
+    LinearTerms(const LinearTerms& other) : n(0) { assign(other.data(), other.n); }
+    LinearTerms& operator = (const LinearTerms& other) { if (this != &other) assign(other.data(), other.n); return *this; }
+
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    Term* begin() { return data(); }
+    Term* end() { return data() + n; }
+    const Term* begin() const { return data(); }
+    const Term* end() const { return data() + n; }
+
+    // coefficient of x[i], inserted as 0 if missing
+    scalar& operator [] (int i){
+        Term* t = data();
+        int k = 0;
+        while (k < n && t[k].first < i)
+            k++;
+        if (k < n && t[k].first == i)
+            return t[k].second;
+
+        if (n == inlineCapacity) {
+            large.assign(small, small + n);
+        }
+        if (large.empty()) {
+            std::copy_backward(small + k, small + n, small + n + 1);
+            small[k] = Term{i, scalar(0)};
+            n++;
+            return small[k].second;
+        } else {
+            large.insert(large.begin() + k, Term{i, scalar(0)});
+            n++;
+            return large[k].second;
+        }
+    }
+
+    void scale(scalar k){ for (Term& t : *this) t.second *= k; }
+
+    // sets the terms of an expression node, summing repeated indices
+    template <typename E>
+    void collect(const E& e);
+
+    // this += k * other, merging the two sorted sequences
+    void addScaled(const LinearTerms& other, scalar k){
+        Term buf[2 * inlineCapacity];
+        std::vector<Term> heapbuf;
+        Term* out = buf;
+        if (n + other.n > 2 * inlineCapacity) {
+            heapbuf.resize(n + other.n);
+            out = heapbuf.data();
+        }
+
+        const Term* a = data();
+        const Term* b = other.data();
+        int i = 0, j = 0, m = 0;
+        while (i < n && j < other.n) {
+            if (a[i].first < b[j].first) {
+                out[m++] = a[i++];
+            } else if (b[j].first < a[i].first) {
+                out[m++] = Term{b[j].first, k * b[j].second};
+                j++;
+            } else {
+                out[m++] = Term{a[i].first, a[i].second + k * b[j].second};
+                i++;
+                j++;
+            }
+        }
+        while (i < n)
+            out[m++] = a[i++];
+        for (; j < other.n; ++j)
+            out[m++] = Term{b[j].first, k * b[j].second};
+
+        assign(out, m);
+    }
+};
+
+
+/* Expression templates: arithmetic on linear expressions builds lightweight nodes that
+   are only evaluated when converted to a LinearExp or passed to addEquation.
+   A node implements
+     forEachTerm(k, f)  calls f(i, k * a[i]) for each term, possibly repeating i
+     constant()         the constant term b
+     termBound()        an upper bound on the number of terms visited
+   LinearExp operands are held by reference, so a node must be consumed within the
+   full-expression that creates it (do not store one with auto). */
+
+template <typename Derived>
+struct LinearExpr{
+    const Derived& derived() const { return static_cast<const Derived&>(*this); }
+};
+
+struct LinearExp;
+
+template <typename E> struct LinearOperand { typedef E type; };
+template <> struct LinearOperand<LinearExp> { typedef const LinearExp& type; };
+
+
 // A linear expression: SUM_i{ a[i] * x[i] } + b
 //  also used as linear expressions
-struct LinearExp{
-    std::map<int, scalar> terms; // i --> a[i]
+struct LinearExp : LinearExpr<LinearExp>{
+    LinearTerms terms; // i --> a[i]
     scalar b;
 
     scalar evaluateFor( const std::vector<scalar> & vars ) const {
@@ -38,31 +168,129 @@ struct LinearExp{
 
     LinearExp(scalar c ) : b(c) {}
 
+    /* evaluates an expression node */
+    template <typename E>
+    LinearExp(const LinearExpr<E>& e) : b(e.derived().constant()) {
+        terms.collect(e.derived());
+    }
+
+    /* expression node interface */
+    template <typename F>
+    void forEachTerm(scalar k, F& f) const { for (const auto& t : terms) f(t.first, k * t.second); }
+    scalar constant() const { return b; }
+    int termBound() const { return terms.size(); }
+
     /* in=place operators */
-    void operator *= (scalar k){ b *= k; for (auto& t : terms) t.second *= k; }
+    void operator *= (scalar k){ b *= k; terms.scale(k); }
     void operator /= (scalar k){ b /= k; for (auto& t : terms) t.second /= k; }
     void operator += (scalar c){ b += c; }
     void operator -= (scalar c){ b -= c; }
-    void operator += (const LinearExp & ex){ b += ex.b; for (const auto& t : ex.terms) terms[ t.first ] += t.second;}
-    void operator -= (const LinearExp & ex){ b -= ex.b; for (const auto& t : ex.terms) terms[ t.first ] -= t.second;}
-    void flip() { for (auto& t : terms) t.second = - t.second; b = -b; }
-
-    /* out-of-place operators */
-    LinearExp operator - () const{ LinearExp res = *this; res.flip(); return res; }
-    LinearExp operator + (const LinearExp & other) const { LinearExp res = *this; res += other; return res; }
-    LinearExp operator - (const LinearExp & other) const { LinearExp res = *this; res -= other; return res; }
-    LinearExp operator ==(const LinearExp & other) const { LinearExp res = *this; res -= other; return res; }
-    LinearExp operator - (scalar c) const { LinearExp res = *this; res -= c; return res; }
-    LinearExp operator + (scalar c) const { LinearExp res = *this; res += c; return res; }
-    LinearExp operator * (scalar k) const { LinearExp res = *this; res *= k; return res; }
-    LinearExp operator / (scalar k) const { LinearExp res = *this; res /= k; return res; }
-    LinearExp operator ==(scalar c) const { LinearExp res = *this; res -= c; return res; }
+    void operator += (const LinearExp & ex){ b += ex.b; terms.addScaled(ex.terms, scalar(1)); }
+    void operator -= (const LinearExp & ex){ b -= ex.b; terms.addScaled(ex.terms, scalar(-1)); }
+    void flip() { terms.scale(scalar(-1)); b = -b; }
 
     bool isInvertible() const { return (terms.size() == 1) && (std::abs((terms.begin()->second)) < 1e-4); }
 
 };
 
-inline LinearExp mix(LinearExp a, LinearExp b, scalar t) {
+// k * e
+template <typename E>
+struct LinearScaledExpr : LinearExpr<LinearScaledExpr<E>>{
+    typename LinearOperand<E>::type e;
+    scalar k;
+
+    LinearScaledExpr(const E& _e, scalar _k) : e(_e), k(_k) {}
+
+    template <typename F>
+    void forEachTerm(scalar s, F& f) const { e.forEachTerm(s * k, f); }
+    scalar constant() const { return k * e.constant(); }
+    int termBound() const { return e.termBound(); }
+};
+
+// l + s * r
+template <typename L, typename R>
+struct LinearSumExpr : LinearExpr<LinearSumExpr<L, R>>{
+    typename LinearOperand<L>::type l;
+    typename LinearOperand<R>::type r;
+    scalar s;
+
+    LinearSumExpr(const L& _l, const R& _r, scalar _s) : l(_l), r(_r), s(_s) {}
+
+    template <typename F>
+    void forEachTerm(scalar k, F& f) const { l.forEachTerm(k, f); r.forEachTerm(k * s, f); }
+    scalar constant() const { return l.constant() + s * r.constant(); }
+    int termBound() const { return l.termBound() + r.termBound(); }
+};
+
+// e + c
+template <typename E>
+struct LinearShiftExpr : LinearExpr<LinearShiftExpr<E>>{
+    typename LinearOperand<E>::type e;
+    scalar c;
+
+    LinearShiftExpr(const E& _e, scalar _c) : e(_e), c(_c) {}
+
+    template <typename F>
+    void forEachTerm(scalar k, F& f) const { e.forEachTerm(k, f); }
+    scalar constant() const { return e.constant() + c; }
+    int termBound() const { return e.termBound(); }
+};
+
+template <typename E>
+void LinearTerms::collect(const E& e){
+    Term buf[2 * inlineCapacity];
+    std::vector<Term> heapbuf;
+    Term* out = buf;
+    if (e.termBound() > 2 * inlineCapacity) {
+        heapbuf.resize(e.termBound());
+        out = heapbuf.data();
+    }
+
+    int m = 0;
+    auto push = [&](int i, scalar a) { out[m++] = Term{i, a}; };
+    e.forEachTerm(scalar(1), push);
+
+    std::sort(out, out + m, [](const Term& t0, const Term& t1) { return t0.first < t1.first; });
+    int u = 0;
+    for (int k = 0; k < m; ++k) {
+        if (u > 0 && out[u - 1].first == out[k].first)
+            out[u - 1].second += out[k].second;
+        else
+            out[u++] = out[k];
+    }
+
+    assign(out, u);
+}
+
+/* out-of-place operators */
+template <typename E>
+inline LinearScaledExpr<E> operator - (const LinearExpr<E>& a) { return LinearScaledExpr<E>(a.derived(), -1); }
+template <typename L, typename R>
+inline LinearSumExpr<L, R> operator + (const LinearExpr<L>& a, const LinearExpr<R>& b) { return LinearSumExpr<L, R>(a.derived(), b.derived(), 1); }
+template <typename L, typename R>
+inline LinearSumExpr<L, R> operator - (const LinearExpr<L>& a, const LinearExpr<R>& b) { return LinearSumExpr<L, R>(a.derived(), b.derived(), -1); }
+template <typename L, typename R>
+inline LinearSumExpr<L, R> operator ==(const LinearExpr<L>& a, const LinearExpr<R>& b) { return LinearSumExpr<L, R>(a.derived(), b.derived(), -1); }
+template <typename E>
+inline LinearShiftExpr<E> operator - (const LinearExpr<E>& a, scalar c) { return LinearShiftExpr<E>(a.derived(), -c); }
+template <typename E>
+inline LinearShiftExpr<E> operator + (const LinearExpr<E>& a, scalar c) { return LinearShiftExpr<E>(a.derived(), c); }
+template <typename E>
+inline LinearScaledExpr<E> operator * (const LinearExpr<E>& a, scalar k) { return LinearScaledExpr<E>(a.derived(), k); }
+template <typename E>
+inline LinearScaledExpr<E> operator / (const LinearExpr<E>& a, scalar k) { return LinearScaledExpr<E>(a.derived(), 1 / k); }
+template <typename E>
+inline LinearShiftExpr<E> operator ==(const LinearExpr<E>& a, scalar c) { return LinearShiftExpr<E>(a.derived(), -c); }
+
+/* mix is not a template, otherwise glm::mix(genTypeT, genTypeT, genTypeU) would be a better match */
+typedef LinearSumExpr<LinearScaledExpr<LinearExp>, LinearScaledExpr<LinearExp>> LinearMixExpr;
+typedef LinearSumExpr<LinearScaledExpr<LinearMixExpr>, LinearScaledExpr<LinearMixExpr>> LinearBilinearExpr;
+
+inline LinearMixExpr mix(const LinearExp& a, const LinearExp& b, scalar t) {
+    return a * (1 - t) + b * t;
+}
+
+inline LinearBilinearExpr mix(const LinearMixExpr& a, const LinearMixExpr& b, scalar t) {
     return a * (1 - t) + b * t;
 }
 
@@ -72,10 +300,14 @@ inline LinearExp constant(scalar c) { return LinearExp(c); }
 inline LinearExp variable(int i) { return LinearExp(i); }
 
 /* commuativity...*/
-inline LinearExp operator * (scalar k, const LinearExp &a ) { return a*k;}
-inline LinearExp operator + (scalar k, const LinearExp &a ) { return a+k;}
-inline LinearExp operator - (scalar k, const LinearExp &a ) { return -a+k;}
-inline LinearExp operator ==(scalar k, const LinearExp &a ) { return a==k;}
+template <typename E>
+inline LinearScaledExpr<E> operator * (scalar k, const LinearExpr<E> &a ) { return a*k;}
+template <typename E>
+inline LinearShiftExpr<E> operator + (scalar k, const LinearExpr<E> &a ) { return a+k;}
+template <typename E>
+inline LinearShiftExpr<LinearScaledExpr<E>> operator - (scalar k, const LinearExpr<E> &a ) { return -a+k;}
+template <typename E>
+inline LinearShiftExpr<E> operator ==(scalar k, const LinearExpr<E> &a ) { return a==k;}
 
 
 
@@ -346,20 +578,271 @@ inline LinearVec2 operator * ( vec2 b , LinearExp a) { return a*b; }
 
 
 
+// The normal equations (A^T A) x = A^T b of a block of equations, accumulated one
+// equation at a time so that the rows of A are never stored.
+// With b = rhs - constant term, atb and btb refer to the single right hand side
+// (rhs = 0), atb3 and btb3 to the per channel right hand sides.
+struct NormalEquations{
+    std::vector<std::vector<std::pair<int, scalar>>> cols; // lower triangle of A^T A, per column: (row, value)
+    std::vector<scalar> atb;
+    std::vector<dvec3> atb3;
+    scalar btb = 0;
+    dvec3 btb3 = dvec3(0);
+
+    int nvar() const { return cols.size(); }
+
+    void reserve( int n ){
+        if (nvar() < n) {
+            cols.resize(n);
+            atb.resize(n, 0);
+            atb3.resize(n, dvec3(0));
+        }
+    }
+
+    // adds v to the entry (row, col) of the lower triangle, row >= col
+    void addEntry( int row, int col, scalar v ){
+        std::vector<std::pair<int, scalar>>& c = cols[col];
+        auto it = c.begin();
+        while (it != c.end() && it->first != row)
+            ++it;
+        if (it != c.end())
+            it->second += v;
+        else
+            c.push_back(std::make_pair(row, v));
+    }
+
+    void add( const LinearExp& e, const dvec3& rhs ){
+        int n = 0;
+        for (const auto& t : e.terms) n = std::max(n, t.first + 1);
+        reserve(n);
+
+        dvec3 b3 = rhs - dvec3(e.b);
+        for (auto ti = e.terms.begin(); ti != e.terms.end(); ++ti) {
+            atb[ti->first] -= ti->second * e.b;
+            atb3[ti->first] += ti->second * b3;
+            // terms are sorted, so (tj, ti) lies in the lower triangle
+            for (auto tj = ti; tj != e.terms.end(); ++tj)
+                addEntry(tj->first, ti->first, ti->second * tj->second);
+        }
+        btb += e.b * e.b;
+        btb3 += b3 * b3;
+    }
+
+    // same as add(e, dvec3(0)) for each of the rows, but the products are first summed in
+    // a small dense matrix over the variables of the rows, so every entry is looked up once
+    void addSquaredSum( const std::vector<LinearExp>& rows ){
+        static constexpr int maxDense = 32;
+
+        int vars[maxDense];
+        int n = 0;
+        for (const LinearExp& e : rows) {
+            for (const auto& t : e.terms) {
+                if (std::find(vars, vars + n, t.first) != vars + n)
+                    continue;
+                if (n == maxDense) {
+                    for (const LinearExp& e : rows)
+                        add(e, dvec3(0));
+                    return;
+                }
+                vars[n++] = t.first;
+            }
+        }
+        std::sort(vars, vars + n);
+        if (n > 0)
+            reserve(vars[n-1] + 1);
+
+        scalar Q[maxDense * maxDense] = {};
+        for (const LinearExp& e : rows) {
+            int pos[maxDense];
+            int nt = 0;
+            for (const auto& t : e.terms) {
+                pos[nt] = std::lower_bound(vars, vars + n, t.first) - vars;
+                atb[t.first] -= t.second * e.b;
+                atb3[t.first] -= t.second * dvec3(e.b);
+                nt++;
+            }
+            for (int i = 0; i < nt; ++i)
+                for (int j = i; j < nt; ++j)
+                    Q[pos[i] * maxDense + pos[j]] += e.terms.begin()[i].second * e.terms.begin()[j].second;
+            btb += e.b * e.b;
+            btb3 += dvec3(e.b * e.b);
+        }
+
+        for (int i = 0; i < n; ++i)
+            for (int j = i; j < n; ++j)
+                if (Q[i * maxDense + j] != 0)
+                    addEntry(vars[j], vars[i], Q[i * maxDense + j]);
+    }
+
+    // ||A x - b||^2, channel -1 refers to the single right hand side
+    scalar squaredErrorFor( const std::vector<scalar> & x, int channel ) const {
+        scalar xAtAx = 0;
+        scalar xAtb = 0;
+        for (int j = 0; j < nvar(); ++j) {
+            for (const auto& e : cols[j])
+                xAtAx += ((e.first == j) ? 1 : 2) * e.second * x[e.first] * x[j];
+            xAtb += x[j] * ((channel < 0) ? atb[j] : atb3[j][channel]);
+        }
+        scalar b2 = (channel < 0) ? btb : btb3[channel];
+        return std::max(scalar(0), xAtAx - 2 * xAtb + b2);
+    }
+};
+
+
+// The sparse solvers LinearEquationSet::solve can use. All but LSCG work on the
+// normal equations (A^T A) x = A^T b; LSCG works on A and needs the rows.
+enum class SolverBackend{
+    LDLT_AMD,          // SimplicialLDLT, AMD ordering
+    LDLT_COLAMD,       // SimplicialLDLT, COLAMD ordering
+    LLT_AMD,           // SimplicialLLT, AMD ordering
+    LLT_COLAMD,        // SimplicialLLT, COLAMD ordering
+    CG_ICHOL,          // ConjugateGradient, IncompleteCholesky preconditioner
+    CG_DIAGONAL,       // ConjugateGradient, diagonal preconditioner
+    LSCG,              // LeastSquaresConjugateGradient
+    MINRES,            // MINRES (unsupported module), diagonal preconditioner
+    CG_MATRIX_FREE,    // ConjugateGradient on the seam samples, A^T A is never assembled (Solver only)
+    CG_BLOCK_JACOBI    // ConjugateGradient, block Jacobi preconditioner over LinearEquationSet::variableGroup
+};
+
+const char *solverBackendName(SolverBackend backend);
+
+/* returns false if the name is unknown */
+bool parseSolverBackend(const std::string& name, SolverBackend& backend);
+
+inline bool solverBackendNeedsRows(SolverBackend backend) { return backend == SolverBackend::LSCG; }
+
+// the others factor A^T A and ignore the initial guess
+inline bool solverBackendIsIterative(SolverBackend backend) { return backend >= SolverBackend::CG_ICHOL; }
+
+// what the last solve did
+struct SolverStats{
+    SolverBackend backend = SolverBackend::LDLT_AMD;
+    long normalNonZeros = 0; // lower triangle of A^T A
+    long factorNonZeros = 0; // (incomplete) Cholesky factor, 0 if there is none
+    int iterations = 0;      // summed over the right hand sides, 0 for direct backends
+    double error = 0;        // largest estimated error of the iterative backends
+    int components = 1;      // independent blocks of variables, solved separately
+    int batches = 1;         // systems the components were solved in
+
+    long fillIn() const { return (factorNonZeros > 0) ? factorNonZeros - normalNonZeros : 0; }
+};
+
+
+struct LDLTFactors; // see factorization_cache.h
+
 struct LinearEquationSet{
     int nvar = 0;
     int neq = 0;
-    std::map<std::string, std::vector<LinearExp>> eqgroups;
 
-    void clear(){ eqgroups.clear(); nvar=0; }
+    SolverBackend backend = SolverBackend::LDLT_AMD;
+    SolverStats stats; // of the last solve
+    bool verbose = true; // print the stats of each solve
+
+    // when the step of a right hand side is > 0, the CG backends (cg-ichol, cg-diagonal, lscg)
+    // stop once none of its variables moved by more than half a step in checkInterval iterations
+    double quantizationStep[3] = {0, 0, 0};
+    int checkInterval = 10;
+
+    // cg-ichol: the pattern of the incomplete factor is that of (A^T A)^(icholFill + 1)
+    int icholFill = 0;
+
+    // cg-block-jacobi: the variables of a group share a diagonal block, and consecutive groups
+    // are merged while the block has at most blockJacobiSize variables. Without groups, the
+    // blocks are runs of consecutive variables
+    std::vector<int> variableGroup;
+    int blockJacobiSize = 64;
+
+    // the CG backends split their products with A^T A over the threads of parallelFor(), see
+    // setThreadCount(), lscg those with A and a row major copy of A^T. Only checked for equal
+    // results, the speedup has not been measured on more than one core
+    bool parallelProducts = false;
+
+    // when set, solve() with an LDLT backend keeps the factors of A^T A
+    bool keepFactors = false;
+    std::shared_ptr<LDLTFactors> factors;
+
+    // the equations in CSR form: row r has the terms (colidx[k], coef[k]) for
+    // k in [rowptr[r], rowptr[r+1]) and the constant term rowb[r]
+    std::vector<int> rowptr = std::vector<int>(1, 0);
+    std::vector<int> colidx;
+    std::vector<scalar> coef;
+    std::vector<scalar> rowb;
+    std::vector<dvec3> rowrhs; // per channel right hand sides, missing rows are zero
+
+    // a named block of equations, made of contiguous row ranges
+    struct Group{
+        std::string name;
+        std::vector<std::pair<int, int>> rows; // [first, last)
+        NormalEquations normal;                // used instead of rows in normalEquations mode
+    };
+    std::vector<Group> groups;
+
+    // when set, equations go straight into the normal equations of their group and no rows are stored
+    bool normalEquations = false;
+
+    // also decides whether the rows are stored, so it must be called before adding equations
+    void setBackend(SolverBackend b){
+        assert(neq == 0);
+        backend = b;
+        normalEquations = !solverBackendNeedsRows(b);
+    }
+
+    void clear(){
+        rowptr.assign(1, 0);
+        colidx.clear();
+        coef.clear();
+        rowb.clear();
+        rowrhs.clear();
+        groups.clear();
+        nvar=0;
+        neq=0;
+        factors.reset();
+        variableGroup.clear();
+    }
+
+    // handle of the named group, registered on first use
+    int group(const std::string& name){
+        int g = findGroup(name);
+        if (g == -1) {
+            g = groups.size();
+            groups.push_back(Group());
+            groups.back().name = name;
+        }
+        return g;
+    }
+
+    int findGroup(const std::string& name) const {
+        for (unsigned g = 0; g < groups.size(); ++g)
+            if (groups[g].name == name)
+                return g;
+        return -1;
+    }
+
+    int nrows() const { return rowb.size(); }
+
+    scalar evaluateRow(int r, const std::vector<scalar> & x) const {
+        scalar res = rowb[r];
+        for (int k = rowptr[r]; k < rowptr[r+1]; ++k)
+            res += coef[k] * x[colidx[k]];
+        return res;
+    }
+
+    // right hand side of row r for the given channel
+    scalar rhsFor(int r, int channel) const {
+        return (r < (int) rowrhs.size()) ? rowrhs[r][channel] : 0;
+    }
 
     void print() const {
         printShort();
-        for (const auto& eqset : eqgroups) {
-            for (const LinearExp &e: eqset.second) {
-                std::cout << "  ";
-                e.print();
-                std::cout << " = 0\n  ";
+        for (const Group& g : groups) {
+            for (const auto& range : g.rows) {
+                for (int r = range.first; r < range.second; ++r) {
+                    std::cout << "  ";
+                    for (int k = rowptr[r]; k < rowptr[r+1]; ++k)
+                        std::cout << coef[k] << "*x[" << colidx[k] << "] + ";
+                    std::cout << rowb[r];
+                    std::cout << " = 0\n  ";
+                }
             }
             std::cout << "\n";
         }
@@ -367,79 +850,149 @@ struct LinearEquationSet{
     }
 
     void printShort() const {
-        unsigned sz = 0;
-        for (const auto& eqset : eqgroups)
-            sz += eqset.second.size();
-        std::cout << sz << " equations on "<< nvar << " variables" << std::endl;;
+        std::cout << neq << " equations on "<< nvar << " variables" << std::endl;;
 
     }
 
-    scalar squaredErrorFor(const std::vector<scalar> & x, const std::string& eqname)
+    // channel -1 ignores the per channel right hand sides
+    scalar squaredErrorFor(const std::vector<scalar> & x, int g, int channel = -1) const
     {
         assert( (int) x.size() >= nvar );
-        assert(eqgroups.count(eqname) > 0);
+        assert(g >= 0 && g < (int) groups.size());
+
+        if (normalEquations)
+            return groups[g].normal.squaredErrorFor(x, channel);
 
         scalar tot = 0;
-        for (const LinearExp& e : eqgroups[eqname]) {
-            scalar err = e.evaluateFor(x);
-            tot += err * err;
+        for (const auto& range : groups[g].rows) {
+            for (int r = range.first; r < range.second; ++r) {
+                scalar err = evaluateRow(r, x) - ((channel < 0) ? 0 : rhsFor(r, channel));
+                tot += err * err;
+            }
         }
         return tot;
     }
 
+    scalar squaredErrorFor(const std::vector<scalar> & x, const std::string& eqname, int channel = -1) const
+    {
+        return squaredErrorFor(x, findGroup(eqname), channel);
+    }
+
     // evaluates a solution in the least square sense
-    scalar squaredErrorFor(const std::vector<scalar> & x){
+    scalar squaredErrorFor(const std::vector<scalar> & x) const {
         assert( (int)x.size() >= nvar  );
         scalar tot = 0;
-        for (const auto& eqset : eqgroups)
-            tot += squaredErrorFor(x, eqset.first);
+        for (unsigned g = 0; g < groups.size(); ++g)
+            tot += squaredErrorFor(x, g);
         return tot;
     }
 
     void initializeVars(std::vector<scalar> & x){
         x.resize(nvar, 0);
-        for (const auto& eqset : eqgroups) {
-            for (const LinearExp &e : eqset.second) {
-                if (e.isInvertible())
-                    x[e.terms.begin()->first] = - (e.b / e.terms.begin()->second);
+        for (int r = 0; r < nrows(); ++r) {
+            int k = rowptr[r];
+            if ((rowptr[r+1] - k == 1) && (std::abs(coef[k]) < 1e-4))
+                x[colidx[k]] = - (rowb[r] / coef[k]);
+        }
+    }
+
+    void append( const LinearExp& v, int g ) {
+        if (normalEquations) {
+            groups[g].normal.add(v, dvec3(0));
+        } else {
+            int r = nrows();
+            for (const auto& t : v.terms) {
+                colidx.push_back(t.first);
+                coef.push_back(t.second);
             }
+            rowptr.push_back(colidx.size());
+            rowb.push_back(v.b);
+
+            std::vector<std::pair<int, int>>& rows = groups[g].rows;
+            if (!rows.empty() && rows.back().second == r)
+                rows.back().second = r + 1;
+            else
+                rows.push_back(std::make_pair(r, r + 1));
+        }
+        neq++;
+    }
+
+    // adds the equations rows[i] == 0 to group g. The normal equations sum their
+    // contribution in one dense block, which is cheaper for rows sharing variables
+    void appendSquaredSum( const std::vector<LinearExp>& rows, int g ) {
+        if (normalEquations) {
+            groups[g].normal.addSquaredSum(rows);
+            neq += rows.size();
+        } else {
+            for (const LinearExp& e : rows)
+                append(e, g);
         }
     }
 
+    // expression nodes are evaluated on the stack, the terms fit in place
+    template <typename E>
+    void append( const LinearExpr<E>& v, int g ) {
+        append(LinearExp(v.derived()), g);
+    }
+
+    // v == rhs[c] for each channel c, see solve(std::vector<std::vector<scalar>>&)
+    template <typename E>
+    void addEquation( const LinearExpr<E>& v, const dvec3& rhs, int g) {
+        if (normalEquations) {
+            groups[g].normal.add(LinearExp(v.derived()), rhs);
+            neq++;
+        } else {
+            rowrhs.resize(nrows(), dvec3(0));
+            append(v, g);
+            rowrhs.push_back(rhs);
+        }
+    }
+
+    template <typename E>
+    void addEquation( const LinearExpr<E>& v, const dvec3& rhs, const std::string& eqsetname) {
+        addEquation(v, rhs, group(eqsetname));
+    }
+
     void addEquation( const LinearVec3& v ) {
-        eqgroups["_default_"].push_back(v.x);
-        eqgroups["_default_"].push_back(v.y);
-        eqgroups["_default_"].push_back(v.z);
-        neq += 3;
+        addEquation(v, group("_default_"));
     }
 
     void addEquation( const LinearVec2& v ) {
-        eqgroups["_default_"].push_back(v.x);
-        eqgroups["_default_"].push_back(v.y);
-        neq += 2;
+        addEquation(v, group("_default_"));
     }
 
-    void addEquation( const LinearExp& v ) {
-        eqgroups["_default_"].push_back(v);
-        neq++;
+    template <typename E>
+    void addEquation( const LinearExpr<E>& v ) {
+        append(v, group("_default_"));
+    }
+
+    void addEquation( const LinearVec3& v, int g) {
+        append(v.x, g);
+        append(v.y, g);
+        append(v.z, g);
+    }
+
+    void addEquation( const LinearVec2& v, int g) {
+        append(v.x, g);
+        append(v.y, g);
+    }
+
+    template <typename E>
+    void addEquation( const LinearExpr<E>& v, int g) {
+        append(v, g);
     }
 
     void addEquation( const LinearVec3& v, const std::string& eqsetname) {
-        eqgroups[eqsetname].push_back(v.x);
-        eqgroups[eqsetname].push_back(v.y);
-        eqgroups[eqsetname].push_back(v.z);
-        neq += 3;
+        addEquation(v, group(eqsetname));
     }
 
     void addEquation( const LinearVec2& v, const std::string& eqsetname) {
-        eqgroups[eqsetname].push_back(v.x);
-        eqgroups[eqsetname].push_back(v.y);
-        neq += 2;
+        addEquation(v, group(eqsetname));
     }
 
-    void addEquation( const LinearExp& v, const std::string& eqsetname) {
-        eqgroups[eqsetname].push_back(v);
-        neq++;
+    template <typename E>
+    void addEquation( const LinearExpr<E>& v, const std::string& eqsetname) {
+        append(v, group(eqsetname));
     }
 
     int newVar() {
@@ -466,6 +1019,9 @@ struct LinearEquationSet{
     /* returns false if the system is underdetermined */
     bool solve( std::vector<scalar> & x );
 
+    /* solves for the 3 right hand side channels at once, factorizing the system only once */
+    bool solve( std::vector<std::vector<scalar>> & x );
+
     /*
     void addEquationsForTriangle( int u0i, int u1i, int u2i,
                                  vec3 p0, vec3 p1, vec3 p2,
@@ -1,63 +1,792 @@
+#include "lineareq.h"
+#include "factorization_cache.h"
+#include "quantized_cg.h"
+#include "parallel.h"
+
 #include <Eigen/Sparse>
 #include <Eigen/IterativeLinearSolvers>
-#include "lineareq.h"
+#include <unsupported/Eigen/IterativeSolvers>
+
+#include <numeric>
 
 using namespace Eigen;
 
-//#define SOLVER_USE_FACTORIZATION
+static const struct {
+    SolverBackend backend;
+    const char *name;
+} backendNames[] = {
+    { SolverBackend::LDLT_AMD,    "ldlt" },
+    { SolverBackend::LDLT_COLAMD, "ldlt-colamd" },
+    { SolverBackend::LLT_AMD,     "llt" },
+    { SolverBackend::LLT_COLAMD,  "llt-colamd" },
+    { SolverBackend::CG_ICHOL,    "cg-ichol" },
+    { SolverBackend::CG_DIAGONAL, "cg-diagonal" },
+    { SolverBackend::LSCG,        "lscg" },
+    { SolverBackend::MINRES,      "minres" },
+    { SolverBackend::CG_MATRIX_FREE, "cg-matrix-free" },
+    { SolverBackend::CG_BLOCK_JACOBI, "cg-block-jacobi" }
+};
 
-bool LinearEquationSet::solve(std::vector<scalar> &solution){
+const char *solverBackendName(SolverBackend backend)
+{
+    for (const auto& entry : backendNames)
+        if (entry.backend == backend)
+            return entry.name;
+    assert(0 && "solverBackendName(): invalid backend");
+    return "";
+}
 
-    int n = nvar;
-    int m = neq;
-    VectorXd x(n), b(m);
+bool parseSolverBackend(const std::string& name, SolverBackend& backend)
+{
+    for (const auto& entry : backendNames) {
+        if (name == entry.name) {
+            backend = entry.backend;
+            return true;
+        }
+    }
+    return false;
+}
+
+// fills A and the nrhs columns of B (nrhs == 1 ignores the per channel right hand sides)
+static void buildSystem(const LinearEquationSet& sys, SparseMatrix<double, RowMajor>& A, MatrixXd& B, int nrhs)
+{
+    int m = sys.nrows();
+
+    // the rows are already stored in compressed row major form
+    A = Map<const SparseMatrix<double, RowMajor>>(m, sys.nvar, sys.colidx.size(),
+                                                  sys.rowptr.data(), sys.colidx.data(), sys.coef.data());
+
+    B.resize(m, nrhs);
+    for (int i = 0; i < m; ++i) {
+        for (int c = 0; c < nrhs; ++c)
+            B(i, c) = -sys.rowb[i] + ((nrhs > 1) ? sys.rhsFor(i, c) : 0);
+    }
+}
+
+// lower triangle of the n x n normal matrix of one group
+static SparseMatrix<double> lowerNormalMatrix(const NormalEquations& ne, int n)
+{
+    SparseMatrix<double> M(n, n);
+
+    int nnz = 0;
+    for (const auto& col : ne.cols)
+        nnz += col.size();
+    M.resizeNonZeros(nnz);
+
+    int p = 0;
+    for (int j = 0; j < n; ++j) {
+        M.outerIndexPtr()[j] = p;
+        if (j < ne.nvar()) {
+            std::vector<std::pair<int, scalar>> col = ne.cols[j];
+            std::sort(col.begin(), col.end());
+            for (const auto& e : col) {
+                M.innerIndexPtr()[p] = e.first;
+                M.valuePtr()[p] = e.second;
+                p++;
+            }
+        }
+    }
+    M.outerIndexPtr()[n] = p;
+
+    return M;
+}
+
+// sums the accumulated normal equations of all the groups
+static void buildNormalSystem(const LinearEquationSet& sys, SparseMatrix<double>& AtA, MatrixXd& Atb, int nrhs)
+{
+    int n = sys.nvar;
+    AtA.resize(n, n);
+    Atb = MatrixXd::Zero(n, nrhs);
+
+    for (const LinearEquationSet::Group& g : sys.groups) {
+        const NormalEquations& ne = g.normal;
+        AtA += lowerNormalMatrix(ne, n);
+        for (int j = 0; j < ne.nvar(); ++j) {
+            if (nrhs > 1) {
+                for (int c = 0; c < nrhs; ++c)
+                    Atb(j, c) += ne.atb3[j][c];
+            } else {
+                Atb(j, 0) += ne.atb[j];
+            }
+        }
+    }
+}
+
+template <typename DirectSolver>
+static bool solveDirect(DirectSolver& solver, const SparseMatrix<double>& AtA, const MatrixXd& Atb, MatrixXd& x, SolverStats& stats)
+{
+    solver.compute(AtA);
+    if (solver.info() != Eigen::Success)
+        return false;
+    stats.factorNonZeros = solver.matrixL().nestedExpression().nonZeros();
+    x = solver.solve(Atb);
+    return (solver.info() == Eigen::Success);
+}
+
+static const double iterativeTolerance = 1e-14;
+
+template <typename IterativeSolver, typename MatrixType>
+static bool solveIterative(IterativeSolver& solver, const MatrixType& M, const MatrixXd& rhs, MatrixXd& x, SolverStats& stats)
+{
+    solver.setTolerance(iterativeTolerance);
+    solver.compute(M);
+    bool ok = (solver.info() == Eigen::Success);
+    for (int c = 0; ok && c < rhs.cols(); ++c) {
+        x.col(c) = solver.solveWithGuess(rhs.col(c), x.col(c));
+        stats.iterations += solver.iterations();
+        stats.error = std::max(stats.error, double(solver.error()));
+        ok = (solver.info() == Eigen::Success);
+    }
+    return ok;
+}
+
+static bool quantizedStopping(const LinearEquationSet& sys, int nrhs)
+{
+    for (int c = 0; c < nrhs; ++c)
+        if (sys.quantizationStep[c] > 0)
+            return true;
+    return false;
+}
+
+// CG with the stopping criterion of conjugateGradientQuantized(), apply(v, out) is out = M v
+template <typename Apply, typename Preconditioner>
+static bool solveQuantized(const LinearEquationSet& sys, const Apply& apply, Preconditioner& precond, const MatrixXd& rhs, MatrixXd& x, SolverStats& stats)
+{
+    if (precond.info() != Eigen::Success)
+        return false;
+    for (int c = 0; c < rhs.cols(); ++c) {
+        VectorXd xc = x.col(c);
+        double error = 0;
+        stats.iterations += conjugateGradientQuantized(apply, precond, VectorXd(rhs.col(c)), xc, iterativeTolerance, 2 * rhs.rows(),
+                                                       0.5 * sys.quantizationStep[c], sys.checkInterval, error);
+        stats.error = std::max(stats.error, error);
+        x.col(c) = xc;
+    }
+    return true;
+}
+
+// y = M x with the rows of M split over parallelFor(); every row is summed by one thread in
+// order, so the result does not depend on the number of threads
+static void parallelProduct(const SparseMatrix<double, RowMajor>& M, const VectorXd& x, VectorXd& y)
+{
+    static const int rowsPerTask = 4096;
+    const int n = M.rows();
+    y.resize(n);
+    parallelFor((n + rowsPerTask - 1) / rowsPerTask, [&](int t, int) {
+        int end = std::min(n, (t + 1) * rowsPerTask);
+        for (int r = t * rowsPerTask; r < end; ++r) {
+            double s = 0;
+            for (SparseMatrix<double, RowMajor>::InnerIterator it(M, r); it; ++it)
+                s += it.value() * x[it.index()];
+            y[r] = s;
+        }
+    });
+}
 
-    SparseMatrix<double> A(m,n);
+// y = M x for the symmetric M of which lower holds the lower triangle, in parallel without the
+// upper triangle: column j is row j of the upper triangle, summed into y[j], and scatters its
+// entries below the diagonal to a buffer of its chunk. The chunks are a fixed split of the
+// columns and their buffers are added in order, so the result does not depend on the number
+// of threads
+class SymmetricProduct {
 
-    // fill A and b
+    static const int chunks = 8; // at most 8 threads scatter, the buffers take <= 8 n doubles
+
+    const SparseMatrix<double>& L;
+    int begin[chunks + 1]; // columns of chunk c, about the same number of entries
+    int rowEnd[chunks];    // chunk c scatters to the rows [begin[c], rowEnd[c])
+    mutable std::vector<double> buffer[chunks];
+
+public:
+    explicit SymmetricProduct(const SparseMatrix<double>& lower) : L(lower)
+    {
+        assert(L.isCompressed());
+        const int n = L.cols();
+        const long nnz = L.outerIndexPtr()[n];
+        begin[0] = 0;
+        for (int c = 1, j = 0; c <= chunks; ++c) {
+            while (j < n && L.outerIndexPtr()[j] < nnz * c / chunks)
+                ++j;
+            begin[c] = (c == chunks) ? n : j;
+        }
+        for (int c = 0; c < chunks; ++c) {
+            rowEnd[c] = begin[c];
+            for (int j = begin[c]; j < begin[c + 1]; ++j)
+                for (SparseMatrix<double>::InnerIterator it(L, j); it; ++it)
+                    rowEnd[c] = std::max(rowEnd[c], int(it.row()) + 1);
+            buffer[c].resize(rowEnd[c] - begin[c]);
+        }
+    }
+
+    void apply(const VectorXd& x, VectorXd& y) const
+    {
+        const int n = L.cols();
+        y.resize(n);
+        parallelFor(chunks, [&](int c, int) {
+            std::fill(buffer[c].begin(), buffer[c].end(), 0.0);
+            double *scatter = buffer[c].data() - begin[c];
+            for (int j = begin[c]; j < begin[c + 1]; ++j) {
+                double s = 0;
+                for (SparseMatrix<double>::InnerIterator it(L, j); it; ++it) {
+                    s += it.value() * x[it.row()];
+                    if (it.row() > j)
+                        scatter[it.row()] += it.value() * x[j];
+                }
+                y[j] = s;
+            }
+        });
+
+        static const int rowsPerTask = 4096;
+        parallelFor((n + rowsPerTask - 1) / rowsPerTask, [&](int t, int) {
+            int first = t * rowsPerTask;
+            int end = std::min(n, first + rowsPerTask);
+            for (int c = 0; c < chunks; ++c) {
+                const double *scatter = buffer[c].data() - begin[c];
+                for (int r = std::max(first, begin[c]); r < std::min(end, rowEnd[c]); ++r)
+                    y[r] += scatter[r];
+            }
+        });
+    }
+};
+
+template <typename LDLTSolver>
+static std::shared_ptr<LDLTFactors> copyFactors(const LDLTSolver& ldlt)
+{
+    std::shared_ptr<LDLTFactors> f = std::make_shared<LDLTFactors>();
+    f->L = ldlt.matrixL().nestedExpression();
+    f->D = ldlt.vectorD();
+    f->P = ldlt.permutationP();
+    return f;
+}
+
+static long lowerNonZeros(const SparseMatrix<double>& M)
+{
+    long nnz = 0;
+    for (int j = 0; j < M.outerSize(); ++j)
+        for (SparseMatrix<double>::InnerIterator it(M, j); it; ++it)
+            if (it.row() >= j)
+                nnz++;
+    return nnz;
+}
+
+// the lower triangle of AtA with explicit zeros where (A^T A)^(level + 1) has entries.
+// IncompleteCholesky keeps as many entries per column as its input has, so this is the
+// memory it gets for fill-in
+static SparseMatrix<double> withFill(const SparseMatrix<double>& AtA, int level)
+{
+    SparseMatrix<double> full = AtA.selfadjointView<Lower>();
+    full.coeffs() = full.coeffs().abs() + 1; // no cancellation in the products below
+    SparseMatrix<double> pattern = full;
+    for (int l = 0; l < level; ++l)
+        pattern = pattern * full;
+    SparseMatrix<double> padded = pattern.triangularView<Lower>();
+    padded = 0 * padded + AtA; // the sum keeps the union of both patterns
+    return padded;
+}
+
+// Block Jacobi preconditioner: the diagonal blocks of A^T A, see LinearEquationSet::variableGroup.
+// Small blocks get a dense Cholesky factorization, large ones a sparse one
+class BlockJacobiPreconditioner
+{
+    static const int maxDenseSize = 128;
+    static const int blocksPerTask = 64;
+
+    std::vector<int> blockBegin; // block k is vars[blockBegin[k], blockBegin[k+1])
+    std::vector<int> vars;
+    std::vector<LLT<MatrixXd>> dense;
+    std::vector<std::unique_ptr<SimplicialLLT<SparseMatrix<double>>>> sparse;
+    ComputationInfo status = Success;
+
+public:
+
+    BlockJacobiPreconditioner(const SparseMatrix<double>& AtA, const std::vector<int>& groups, int maxSize)
     {
-        int i=0;
-        std::vector<Eigen::Triplet<double>> tvec;
-        for (const auto& eqset : eqgroups) {
-            for (const LinearExp& le:eqset.second) {
-                for (const auto& t : le.terms)
-                    tvec.push_back(Eigen::Triplet<double>(i, t.first, t.second));
-                b(i) = -le.b;
-                i++;
-            }
-        }
-        A.setFromTriplets(tvec.begin(), tvec.end());
-    }
-
-#ifdef SOLVER_USE_FACTORIZATION
-    Eigen::SimplicialLDLT<SparseMatrix<double>> ldlt;
-    ldlt.compute(A.transpose() * A);
-    assert(ldlt.info() == Eigen::Success);
-    x = ldlt.solve(A.transpose() * b);
-    bool ok = (ldlt.info() == Eigen::Success);
-    LeastSquaresConjugateGradient< SparseMatrix<double> > lscg;
-#else
-    LeastSquaresConjugateGradient< SparseMatrix<double> > lscg;
-    lscg.compute(A);
-    if (solution.size() != nvar) {
-       initializeVars(solution);
+        const int n = AtA.cols();
+
+        // variables sorted by group, the blocks are cut between groups
+        vars.resize(n);
+        std::iota(vars.begin(), vars.end(), 0);
+        if (!groups.empty())
+            std::stable_sort(vars.begin(), vars.end(), [&groups](int u, int v) { return groups[u] < groups[v]; });
+        blockBegin.push_back(0);
+        for (int i = 0; i < n; ) {
+            int end = i + 1;
+            while (end < n && !groups.empty() && groups[vars[end]] == groups[vars[i]])
+                end++;
+            if (i > blockBegin.back() && end - blockBegin.back() > maxSize)
+                blockBegin.push_back(i);
+            i = end;
+        }
+        blockBegin.push_back(n);
+        const int nblocks = blockBegin.size() - 1;
+
+        std::vector<int> blockOf(n);
+        std::vector<int> local(n);
+        for (int k = 0; k < nblocks; ++k) {
+            for (int i = blockBegin[k]; i < blockBegin[k+1]; ++i) {
+                blockOf[vars[i]] = k;
+                local[vars[i]] = i - blockBegin[k];
+            }
+        }
+
+        dense.resize(nblocks);
+        sparse.resize(nblocks);
+        std::vector<char> ok(nblocks, 1);
+        parallelFor(nblocks, [&](int k, int) {
+            const int nb = blockBegin[k+1] - blockBegin[k];
+            std::vector<Triplet<double>> entries;
+            for (int i = blockBegin[k]; i < blockBegin[k+1]; ++i) {
+                int j = vars[i];
+                for (SparseMatrix<double>::InnerIterator it(AtA, j); it; ++it) {
+                    if (blockOf[it.row()] != k)
+                        continue;
+                    int li = local[it.row()];
+                    int lj = local[j];
+                    // lower triangle of the block
+                    entries.push_back(Triplet<double>(std::max(li, lj), std::min(li, lj), it.value()));
+                }
+            }
+            if (nb <= maxDenseSize) {
+                MatrixXd M = MatrixXd::Zero(nb, nb);
+                for (const Triplet<double>& t : entries)
+                    M(t.row(), t.col()) = t.value();
+                dense[k].compute(M);
+                ok[k] = (dense[k].info() == Success);
+            } else {
+                SparseMatrix<double> M(nb, nb);
+                M.setFromTriplets(entries.begin(), entries.end());
+                sparse[k].reset(new SimplicialLLT<SparseMatrix<double>>(M));
+                ok[k] = (sparse[k]->info() == Success);
+            }
+        });
+        for (char blockOk : ok)
+            if (!blockOk)
+                status = NumericalIssue;
+    }
+
+    int blocks() const { return blockBegin.size() - 1; }
+
+    // of the Cholesky factors, the dense ones counted as lower triangles
+    long nonZeros() const
+    {
+        long nnz = 0;
+        for (int k = 0; k < blocks(); ++k) {
+            long nb = blockBegin[k+1] - blockBegin[k];
+            nnz += sparse[k] ? long(sparse[k]->matrixL().nestedExpression().nonZeros()) : nb * (nb + 1) / 2;
+        }
+        return nnz;
+    }
+
+    template <typename Rhs>
+    VectorXd solve(const MatrixBase<Rhs>& r) const
+    {
+        VectorXd z(r.rows());
+        // the blocks are gathered into, and scattered from, the block order
+        VectorXd rb(r.rows());
+        for (int i = 0; i < r.rows(); ++i)
+            rb[i] = r[vars[i]];
+        parallelFor((blocks() + blocksPerTask - 1) / blocksPerTask, [&](int t, int) {
+            int end = std::min(blocks(), (t + 1) * blocksPerTask);
+            for (int k = t * blocksPerTask; k < end; ++k) {
+                const int nb = blockBegin[k+1] - blockBegin[k];
+                auto segment = rb.segment(blockBegin[k], nb);
+                if (sparse[k])
+                    segment = sparse[k]->solve(VectorXd(segment));
+                else
+                    dense[k].solveInPlace(segment);
+            }
+        });
+        for (int i = 0; i < r.rows(); ++i)
+            z[vars[i]] = rb[i];
+        return z;
+    }
+
+    ComputationInfo info() const { return status; }
+};
+
+// solves the assembled system with backend, A and b are only set when the backend needs
+// the rows, AtA and Atb otherwise; groups replaces sys.variableGroup, as the variables may be
+// renumbered; factors is set if sys.keepFactors and the backend is LDLT
+static bool solveAssembled(const LinearEquationSet& sys, SolverBackend backend, const SparseMatrix<double, RowMajor>& A, const MatrixXd& b,
+                           const SparseMatrix<double>& AtA, const MatrixXd& Atb, const std::vector<int>& groups,
+                           MatrixXd& x, int nrhs, SolverStats& stats, std::shared_ptr<LDLTFactors>& factors)
+{
+    stats = SolverStats();
+    stats.backend = backend;
+    factors.reset();
+    stats.normalNonZeros = solverBackendNeedsRows(backend) ? 0 : lowerNonZeros(AtA);
+
+    const bool quantized = quantizedStopping(sys, nrhs);
+
+    // the products of Eigen are serial, the threaded mode uses SymmetricProduct on the lower
+    // triangle of AtA and a row major copy of A^T for lscg. Batches of components are already
+    // solved in parallel
+    const bool parallel = sys.parallelProducts && threadCount() > 1 && !inParallelFor();
+    SparseMatrix<double, RowMajor> At;
+    if (parallel && backend == SolverBackend::LSCG)
+        At = A.transpose();
+    std::unique_ptr<SymmetricProduct> symmetricProduct;
+    if (parallel && (backend == SolverBackend::CG_ICHOL || backend == SolverBackend::CG_DIAGONAL || backend == SolverBackend::CG_BLOCK_JACOBI))
+        symmetricProduct.reset(new SymmetricProduct(AtA));
+
+    auto normalApply = [&](const VectorXd& v, VectorXd& out) {
+        if (parallel)
+            symmetricProduct->apply(v, out);
+        else
+            out.noalias() = AtA.selfadjointView<Lower>() * v;
+    };
+
+    // only the lower triangle of AtA is read
+    bool ok = false;
+    switch (backend) {
+    case SolverBackend::LDLT_AMD: {
+        SimplicialLDLT<SparseMatrix<double>, Lower, AMDOrdering<int>> ldlt;
+        ok = solveDirect(ldlt, AtA, Atb, x, stats);
+        stats.factorNonZeros += AtA.rows(); // the unit diagonal of L is not stored, count D instead
+        if (ok && sys.keepFactors)
+            factors = copyFactors(ldlt);
+        break;
+    }
+    case SolverBackend::LDLT_COLAMD: {
+        SimplicialLDLT<SparseMatrix<double>, Lower, COLAMDOrdering<int>> ldlt;
+        ok = solveDirect(ldlt, AtA, Atb, x, stats);
+        stats.factorNonZeros += AtA.rows(); // the unit diagonal of L is not stored, count D instead
+        if (ok && sys.keepFactors)
+            factors = copyFactors(ldlt);
+        break;
+    }
+    case SolverBackend::LLT_AMD: {
+        SimplicialLLT<SparseMatrix<double>, Lower, AMDOrdering<int>> llt;
+        ok = solveDirect(llt, AtA, Atb, x, stats);
+        break;
+    }
+    case SolverBackend::LLT_COLAMD: {
+        SimplicialLLT<SparseMatrix<double>, Lower, COLAMDOrdering<int>> llt;
+        ok = solveDirect(llt, AtA, Atb, x, stats);
+        break;
+    }
+    case SolverBackend::CG_ICHOL: {
+        if (quantized || sys.icholFill > 0 || parallel) {
+            IncompleteCholesky<double, Lower, AMDOrdering<int>> ichol(sys.icholFill > 0 ? withFill(AtA, sys.icholFill) : AtA);
+            ok = solveQuantized(sys, normalApply, ichol, Atb, x, stats);
+            stats.factorNonZeros = ichol.matrixL().nonZeros();
+            break;
+        }
+        ConjugateGradient<SparseMatrix<double>, Lower, IncompleteCholesky<double, Lower, AMDOrdering<int>>> cg;
+        ok = solveIterative(cg, AtA, Atb, x, stats);
+        stats.factorNonZeros = cg.preconditioner().matrixL().nonZeros();
+        break;
+    }
+    case SolverBackend::CG_MATRIX_FREE: // solveLeastSquares() replaces it, the closest assembled backend
+    case SolverBackend::CG_DIAGONAL: {
+        if (quantized || parallel) {
+            DiagonalPreconditioner<double> diagonal(AtA);
+            ok = solveQuantized(sys, normalApply, diagonal, Atb, x, stats);
+            break;
+        }
+        ConjugateGradient<SparseMatrix<double>, Lower, DiagonalPreconditioner<double>> cg;
+        ok = solveIterative(cg, AtA, Atb, x, stats);
+        break;
+    }
+    case SolverBackend::LSCG: {
+        if (quantized || parallel) {
+            // CG on A^T A x = A^T b, A^T A is applied as A^T (A v)
+            LeastSquareDiagonalPreconditioner<double> diagonal(A);
+            VectorXd Av;
+            auto lsApply = [&](const VectorXd& v, VectorXd& out) {
+                if (parallel) {
+                    parallelProduct(A, v, Av);
+                    parallelProduct(At, Av, out);
+                } else {
+                    out.noalias() = A.transpose() * (A * v);
+                }
+            };
+            ok = solveQuantized(sys, lsApply, diagonal, MatrixXd(A.transpose() * b), x, stats);
+            break;
+        }
+        LeastSquaresConjugateGradient<SparseMatrix<double, RowMajor>> lscg;
+        ok = solveIterative(lscg, A, b, x, stats);
+        break;
+    }
+    case SolverBackend::CG_BLOCK_JACOBI: {
+        BlockJacobiPreconditioner blockJacobi(AtA, groups, sys.blockJacobiSize);
+        ok = solveQuantized(sys, normalApply, blockJacobi, Atb, x, stats);
+        stats.factorNonZeros = blockJacobi.nonZeros();
+        break;
+    }
+    case SolverBackend::MINRES: {
+        Eigen::MINRES<SparseMatrix<double>, Lower, DiagonalPreconditioner<double>> minres;
+        ok = solveIterative(minres, AtA, Atb, x, stats);
+        break;
+    }
+    }
+
+    return ok;
+}
+
+// groups the variables in connected components: two variables are connected when they appear
+// in the same equation, which is when A^T A has an entry for them. Returns the number of
+// components, component[v] is numbered in the order of the first variable of each component
+static int findComponents(const SparseMatrix<double, RowMajor>& A, const SparseMatrix<double>& AtA, bool rows, std::vector<int>& component)
+{
+    const int n = rows ? A.cols() : AtA.cols();
+
+    std::vector<int> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&parent](int v) {
+        while (parent[v] != v)
+            v = parent[v] = parent[parent[v]];
+        return v;
+    };
+    auto unite = [&](int u, int v) {
+        u = find(u);
+        v = find(v);
+        if (u != v)
+            parent[std::max(u, v)] = std::min(u, v);
+    };
+
+    if (rows) {
+        for (int r = 0; r < A.outerSize(); ++r) {
+            SparseMatrix<double, RowMajor>::InnerIterator it(A, r);
+            if (!it)
+                continue;
+            int first = it.col();
+            for (++it; it; ++it)
+                unite(first, it.col());
+        }
     } else {
-        for (int i=0; i<n; i++)
-            x[i] = solution[i] ;
-    }
-    lscg.setTolerance(1e-14);
-    x = lscg.solveWithGuess(b,x);
-    //x = lscg.solve(b);
-    std::cout << "#iterations:     " << lscg.iterations() << std::endl;
-    std::cout << "estimated error: " << lscg.error()      << std::endl;
-    /*// update b, and solve again
-    x = lscg.solve(b);*/
-    bool ok = (lscg.info() == Eigen::Success);
-#endif
+        for (int j = 0; j < AtA.outerSize(); ++j)
+            for (SparseMatrix<double>::InnerIterator it(AtA, j); it; ++it)
+                unite(it.row(), j);
+    }
+
+    // the root of a component is its smallest variable
+    int ncomp = 0;
+    component.resize(n);
+    for (int v = 0; v < n; ++v)
+        component[v] = (find(v) == v) ? ncomp++ : component[find(v)];
+    return ncomp;
+}
+
+// components with fewer variables are solved together, in one system
+static const int minBatchSize = 1024;
+
+// solves every batch of components on its own, in parallel
+static bool solveComponents(const LinearEquationSet& sys, SolverBackend backend, const SparseMatrix<double, RowMajor>& A, const MatrixXd& b,
+                            const SparseMatrix<double>& AtA, const MatrixXd& Atb, MatrixXd& x, int nrhs,
+                            const std::vector<int>& component, int ncomp, SolverStats& stats)
+{
+    const bool rows = solverBackendNeedsRows(backend);
+    const int n = x.rows();
+
+    std::vector<int> compSize(ncomp, 0);
+    for (int c : component)
+        compSize[c]++;
+
+    // the largest first, so that they get started first
+    std::vector<int> order(ncomp);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&compSize](int c1, int c2) { return compSize[c1] > compSize[c2]; });
+
+    // batches are contiguous ranges [batchBegin[k], batchBegin[k+1]) of the reordered variables
+    std::vector<int> compBatch(ncomp);
+    std::vector<int> compOffset(ncomp);
+    std::vector<int> batchBegin(1, 0);
+    int open = -1;
+    for (int c : order) {
+        if (open == -1) {
+            open = batchBegin.size() - 1;
+            batchBegin.push_back(batchBegin.back());
+        }
+        compBatch[c] = open;
+        compOffset[c] = batchBegin.back();
+        batchBegin.back() += compSize[c];
+        if (batchBegin.back() - batchBegin[open] >= minBatchSize)
+            open = -1;
+    }
+    const int nbatch = batchBegin.size() - 1;
+
+    // variables keep their order within a component
+    PermutationMatrix<Dynamic, Dynamic, int> perm(n);
+    for (int v = 0; v < n; ++v)
+        perm.indices()[v] = compOffset[component[v]]++;
+
+    MatrixXd xp = perm * x;
+
+    SparseMatrix<double> AtAp;
+    MatrixXd Atbp;
+    std::vector<std::vector<Triplet<double>>> batchTriplets;
+    std::vector<std::vector<int>> batchRows;
+    if (rows) {
+        // the rows of a batch, with their columns renumbered within the batch
+        batchTriplets.resize(nbatch);
+        batchRows.resize(nbatch);
+        for (int r = 0; r < A.outerSize(); ++r) {
+            SparseMatrix<double, RowMajor>::InnerIterator first(A, r);
+            if (!first)
+                continue;
+            int k = compBatch[component[first.col()]];
+            int row = batchRows[k].size();
+            batchRows[k].push_back(r);
+            for (SparseMatrix<double, RowMajor>::InnerIterator it(A, r); it; ++it)
+                batchTriplets[k].push_back(Triplet<double>(row, perm.indices()[it.col()] - batchBegin[k], it.value()));
+        }
+    } else {
+        AtAp.resize(n, n);
+        AtAp.selfadjointView<Lower>() = AtA.selfadjointView<Lower>().twistedBy(perm);
+        Atbp = perm * Atb;
+    }
+
+    std::vector<int> groupp(sys.variableGroup.size());
+    for (unsigned v = 0; v < sys.variableGroup.size(); ++v)
+        groupp[perm.indices()[v]] = sys.variableGroup[v];
+
+    std::vector<SolverStats> batchStats(nbatch);
+    std::vector<char> batchOk(nbatch, 0);
+    parallelFor(nbatch, [&](int k, int) {
+        int b0 = batchBegin[k];
+        int nb = batchBegin[k+1] - b0;
+
+        SparseMatrix<double, RowMajor> Ak;
+        MatrixXd bk;
+        SparseMatrix<double> AtAk;
+        MatrixXd Atbk;
+        if (rows) {
+            Ak.resize(batchRows[k].size(), nb);
+            Ak.setFromTriplets(batchTriplets[k].begin(), batchTriplets[k].end());
+            bk.resize(batchRows[k].size(), nrhs);
+            for (unsigned i = 0; i < batchRows[k].size(); ++i)
+                bk.row(i) = b.row(batchRows[k][i]);
+        } else {
+            AtAk = AtAp.block(b0, b0, nb, nb);
+            Atbk = Atbp.middleRows(b0, nb);
+        }
+
+        std::vector<int> groupk;
+        if (!groupp.empty())
+            groupk.assign(groupp.begin() + b0, groupp.begin() + b0 + nb);
+
+        MatrixXd xk = xp.middleRows(b0, nb);
+        std::shared_ptr<LDLTFactors> unused;
+        batchOk[k] = solveAssembled(sys, backend, Ak, bk, AtAk, Atbk, groupk, xk, nrhs, batchStats[k], unused);
+        xp.middleRows(b0, nb) = xk;
+    });
+
+    x = perm.transpose() * xp;
+
+    stats = SolverStats();
+    stats.backend = backend;
+    stats.components = ncomp;
+    stats.batches = nbatch;
+    bool ok = true;
+    for (int k = 0; k < nbatch; ++k) {
+        stats.normalNonZeros += batchStats[k].normalNonZeros;
+        stats.factorNonZeros += batchStats[k].factorNonZeros;
+        stats.iterations += batchStats[k].iterations;
+        stats.error = std::max(stats.error, batchStats[k].error);
+        ok = ok && batchOk[k];
+    }
+    return ok;
+}
+
+// x holds the initial guess for the iterative backends, and it is overwritten with the solution;
+// factors is set if sys.keepFactors and the backend is LDLT
+static bool solveLeastSquares(const LinearEquationSet& sys, MatrixXd& x, int nrhs, SolverStats& stats, std::shared_ptr<LDLTFactors>& factors)
+{
+    SolverBackend backend = sys.backend;
+    if (sys.normalEquations && solverBackendNeedsRows(backend)) {
+        // LSCG is CG on the normal equations with the diagonal of A^T A as preconditioner
+        if (sys.verbose)
+            std::cout << "The rows are not stored, using " << solverBackendName(SolverBackend::CG_DIAGONAL) << std::endl;
+        backend = SolverBackend::CG_DIAGONAL;
+    }
+    if (backend == SolverBackend::CG_MATRIX_FREE) {
+        // only Solver knows the seam samples, a general system gets the closest assembled backend
+        if (sys.verbose)
+            std::cout << "The equations are not seam samples, using " << solverBackendName(SolverBackend::CG_DIAGONAL) << std::endl;
+        backend = SolverBackend::CG_DIAGONAL;
+    }
+
+    SparseMatrix<double, RowMajor> A;
+    MatrixXd b;
+
+    SparseMatrix<double> AtA;
+    MatrixXd Atb;
+
+    if (sys.normalEquations) {
+        buildNormalSystem(sys, AtA, Atb, nrhs);
+    } else {
+        buildSystem(sys, A, b, nrhs);
+        if (!solverBackendNeedsRows(backend)) {
+            AtA = A.transpose() * A;
+            Atb = A.transpose() * b;
+            A.resize(0, 0);
+        }
+    }
+
+    // independent components are solved separately, unless the factors of the whole system are kept
+    std::vector<int> component;
+    int ncomp = sys.keepFactors ? 1 : findComponents(A, AtA, solverBackendNeedsRows(backend), component);
+
+    bool ok = false;
+    if (ncomp > 1) {
+        factors.reset();
+        ok = solveComponents(sys, backend, A, b, AtA, Atb, x, nrhs, component, ncomp, stats);
+    } else {
+        ok = solveAssembled(sys, backend, A, b, AtA, Atb, sys.variableGroup, x, nrhs, stats, factors);
+    }
+
+    if (sys.verbose) {
+        std::cout << solverBackendName(backend) << ": nnz(A^T A) = " << stats.normalNonZeros
+                  << ", nnz(L) = " << stats.factorNonZeros << ", fill-in = " << stats.fillIn()
+                  << ", #iterations = " << stats.iterations << ", estimated error = " << stats.error;
+        if (stats.components > 1)
+            std::cout << ", " << stats.components << " components in " << stats.batches << " batches";
+        std::cout << std::endl;
+    }
+
+    return ok;
+}
+
+bool LinearEquationSet::solve(std::vector<scalar> &solution){
+
+    int n = nvar;
+    MatrixXd x(n, 1);
+
+    if (solution.size() != size_t(nvar))
+        initializeVars(solution);
+    for (int i=0; i<n; i++)
+        x(i, 0) = solution[i];
+
+    bool ok = solveLeastSquares(*this, x, 1, stats, factors);
 
     solution.resize(n);
     for (int i=0; i<n; i++)
-        solution[i] = x[i];
+        solution[i] = x(i, 0);
+
+    return ok;
+}
+
+bool LinearEquationSet::solve(std::vector<std::vector<scalar>> &solution){
+
+    const int nrhs = 3;
+
+    int n = nvar;
+    MatrixXd x = MatrixXd::Zero(n, nrhs);
+
+    for (int c = 0; c < nrhs; ++c) {
+        if (solution.size() == size_t(nrhs) && solution[c].size() == size_t(nvar))
+            x.col(c) = Map<const VectorXd>(solution[c].data(), n);
+    }
+
+    bool ok = solveLeastSquares(*this, x, nrhs, stats, factors);
+
+    solution.resize(nrhs);
+    for (int c = 0; c < nrhs; ++c) {
+        solution[c].resize(n);
+        for (int i=0; i<n; i++)
+            solution[c][i] = x(i, c);
+    }
 
     return ok;
 }
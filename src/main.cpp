@@ -7,18 +7,28 @@
 #include "metric.h"
 
 #include "block_partitioner.h"
+#include "compress_squish.h"
+#include "factorization_cache.h"
+#include "parallel.h"
 
 #include <set>
+#include <map>
 #include <algorithm>
 #include <chrono>
 
-static void parseArgs(int argc, char *argv[], std::vector<std::string>& positionalArgs, std::set<char>& options)
+static void parseArgs(int argc, char *argv[], std::vector<std::string>& positionalArgs, std::set<char>& options,
+                      std::map<std::string, std::string>& namedArgs)
 {
     positionalArgs.clear();
     options.clear();
+    namedArgs.clear();
     for (int i = 1; i < argc; ++i) {
         std::string arg(argv[i]);
-        if (arg[0] == '-' && arg.size() == 2) {
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") == 0 && eq != std::string::npos) {
+            namedArgs[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+            std::cout << "Found argument: " << arg.substr(2) << std::endl;
+        } else if (arg[0] == '-' && arg.size() == 2) {
             options.insert(arg[1]);
             std::cout << "Found option: " << arg[1] << std::endl;
         } else if (arg[0] != '-') {
@@ -35,8 +45,9 @@ int main(int argc, char *argv[])
 {
     std::vector<std::string> positionalArgs;
     std::set<char> options;
+    std::map<std::string, std::string> namedArgs;
 
-    parseArgs(argc, argv, positionalArgs, options);
+    parseArgs(argc, argv, positionalArgs, options, namedArgs);
 
     if (positionalArgs.size() < 2) {
         std::cerr << "Usage: " << argv[0] << " obj texture [-c]" << std::endl;
@@ -119,14 +130,129 @@ int main(int argc, char *argv[])
 {
     std::vector<std::string> positionalArgs;
     std::set<char> options;
+    std::map<std::string, std::string> namedArgs;
 
-    parseArgs(argc, argv, positionalArgs, options);
+    parseArgs(argc, argv, positionalArgs, options, namedArgs);
 
     if (positionalArgs.size() < 2) {
-        std::cerr << "Usage: " << argv[0] << " obj texture [-c]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " obj texture [-c] [-b] [--solver=backend] [--seams=point|integrated] [--cache=dir] [--coarse-levels=n] [--stop=residual|quantized] [--ichol-fill=k] [--threads=n] [--spmv=serial|parallel] [--encoder=scalar|batched] [--endpoint-refinements=n] [--dds=levels] [--squish-seam-weight=w]" << std::endl;
+        std::cerr << "  --spmv=parallel splits the sparse products of the iterative solvers over the threads, its speedup is unmeasured" << std::endl;
+        std::exit(-1);
+    }
+
+    SolverBackend backend = SolverBackend::LDLT_AMD;
+    if (namedArgs.count("solver") && !parseSolverBackend(namedArgs["solver"], backend)) {
+        std::cerr << "Unknown solver backend " << namedArgs["solver"] << ", valid backends are:";
+        for (int b = 0; b <= int(SolverBackend::CG_BLOCK_JACOBI); ++b)
+            std::cerr << " " << solverBackendName(SolverBackend(b));
+        std::cerr << std::endl;
         std::exit(-1);
     }
 
+    SeamSampleSet::Mode seamSampling = SeamSampleSet::Mode::Point;
+    if (namedArgs.count("seams")) {
+        if (namedArgs["seams"] == "integrated") {
+            seamSampling = SeamSampleSet::Mode::Integrated;
+        } else if (namedArgs["seams"] != "point") {
+            std::cerr << "Unknown seam sampling " << namedArgs["seams"] << ", valid values are: point integrated" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    int coarseLevels = 0;
+    if (namedArgs.count("coarse-levels")) {
+        coarseLevels = std::atoi(namedArgs["coarse-levels"].c_str());
+        if (coarseLevels < 0) {
+            std::cerr << "Invalid number of coarse levels " << namedArgs["coarse-levels"] << std::endl;
+            std::exit(-1);
+        }
+        if (coarseLevels > 0 && !solverBackendIsIterative(backend)) {
+            std::cerr << "Warning: --coarse-levels only speeds up the iterative backends, ignored with " << solverBackendName(backend) << std::endl;
+            coarseLevels = 0;
+        }
+    }
+
+    int icholFill = 0;
+    if (namedArgs.count("ichol-fill")) {
+        icholFill = std::atoi(namedArgs["ichol-fill"].c_str());
+        if (icholFill < 0) {
+            std::cerr << "Invalid fill level " << namedArgs["ichol-fill"] << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    // 0 is one thread per core
+    if (namedArgs.count("threads")) {
+        int threads = std::atoi(namedArgs["threads"].c_str());
+        if (threads < 0) {
+            std::cerr << "Invalid number of threads " << namedArgs["threads"] << std::endl;
+            std::exit(-1);
+        }
+        setThreadCount(threads);
+    }
+
+    bool parallelProducts = false;
+    if (namedArgs.count("spmv")) {
+        if (namedArgs["spmv"] == "parallel") {
+            parallelProducts = true;
+        } else if (namedArgs["spmv"] != "serial") {
+            std::cerr << "Unknown product mode " << namedArgs["spmv"] << ", valid values are: serial parallel" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    bool quantizedStopping = false;
+    if (namedArgs.count("stop")) {
+        if (namedArgs["stop"] == "quantized") {
+            quantizedStopping = true;
+        } else if (namedArgs["stop"] != "residual") {
+            std::cerr << "Unknown stopping criterion " << namedArgs["stop"] << ", valid values are: residual quantized" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    bool batchedEncoder = false;
+    if (namedArgs.count("encoder")) {
+        if (namedArgs["encoder"] == "batched") {
+            batchedEncoder = true;
+        } else if (namedArgs["encoder"] != "scalar") {
+            std::cerr << "Unknown block encoder " << namedArgs["encoder"] << ", valid values are: scalar batched" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    // rounds of refitting the block endpoints after the first fit, see CompressedImage::endpointRefinements
+    int endpointRefinements = 0;
+    if (namedArgs.count("endpoint-refinements")) {
+        endpointRefinements = std::atoi(namedArgs["endpoint-refinements"].c_str());
+        if (endpointRefinements < 0) {
+            std::cerr << "Invalid number of endpoint refinements " << namedArgs["endpoint-refinements"] << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    // with --dds=levels the compressed textures are also saved as DDS, with levels mip levels
+    // (0 for the whole chain) encoded from the seamless texture
+    int ddsLevels = -1;
+    if (namedArgs.count("dds")) {
+        ddsLevels = std::atoi(namedArgs["dds"].c_str());
+        if (ddsLevels < 0) {
+            std::cerr << "Invalid number of mip levels " << namedArgs["dds"] << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    // with --squish-seam-weight=w the texture is also compressed with libsquish, the seam pixels
+    // weighted w, the internal ones 1 and the others 0
+    float squishSeamWeight = 0;
+    if (namedArgs.count("squish-seam-weight")) {
+        squishSeamWeight = std::atof(namedArgs["squish-seam-weight"].c_str());
+        if (squishSeamWeight <= 0) {
+            std::cerr << "Invalid seam weight " << namedArgs["squish-seam-weight"] << std::endl;
+            std::exit(-1);
+        }
+    }
+
     auto n1 = positionalArgs[0].find_last_of('/');
     if (n1 == std::string::npos)
         n1 = 0;
@@ -146,23 +272,65 @@ int main(int argc, char *argv[])
     m.mirrorV();
 
     std::cout << "Loading texture..." << std::endl;
+    // a DXT1 .dds texture gets its seams fixed on its blocks, see below
+    const std::string& textureName = positionalArgs[1];
+    bool ddsTexture = textureName.size() > 4 && textureName.compare(textureName.size() - 4, 4, ".dds") == 0;
+    CompressedImage ctexture;
     Image img;
-    img.load(positionalArgs[1].c_str());
+    if (ddsTexture) {
+        if (!ctexture.load(textureName.c_str())) {
+            std::cerr << "Cannot read " << textureName << ", only DXT1 textures with sizes multiple of 4 are supported" << std::endl;
+            std::exit(-1);
+        }
+        ctexture.decode(img);
+    } else {
+        img.load(textureName.c_str());
+    }
 
     std::cout << "Saving source texture..." << std::endl;
     img.save("source_texture.png");
 
+    std::cout << "Sampling seams..." << std::endl;
+    SeamSampleSet samples(m, img.resx, img.resy, seamSampling);
+
     std::cout << "Computing pixel masks..." << std::endl;
 
     unsigned ni = img.setMaskInternal(m);
-    unsigned ns = img.setMaskSeam(m);
+    unsigned ns = img.setMaskSeam(samples);
 
     std::cout << ni << " internal pixels, " << ns << " seam pixels" << std::endl;
 
+    if (options.find('b') != options.end()) {
+        Solver(backend).benchmarkSeamEquations(m, img.resx, img.resy);
+        Solver(backend).benchmarkStoppingCriteria(samples, img, 0.5);
+        Solver().benchmarkPreconditioners(samples, img, 0.5);
+        CompressedImage::benchmarkEncoders(img, Image::MaskBit::Internal | Image::MaskBit::Seam, endpointRefinements);
+        return 0;
+    }
+
+    // -- seam-aware fix of the dds blocks -------------------------------------
+    // only the blocks with seam variables are encoded again, the others are written as read
+    if (ddsTexture) {
+        std::cout << "Solving seam-aware compression on the texture blocks..." << std::endl;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        SolverCompressedImage solver(backend);
+        solver.setQuantizedStopping(quantizedStopping);
+        solver.setParallelProducts(parallelProducts);
+        solver.fixSeamsSeparateChannels(samples, img, ctexture, 0.5);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::cout << "Optimization took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
+        std::string textureOutName = meshName + "_sac.png";
+        std::string meshOutName = meshName + "_sac";
+        ctexture.save((meshName + "_sac.dds").c_str());
+        ctexture.saveUncompressed(textureOutName.c_str());
+        m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
+        return 0;
+    }
+
     auto t0 = std::chrono::high_resolution_clock::now();
     BlockPartitioner bp;
     bp.init(img.resx, img.resy);
-    bp.computePartitions(m);
+    bp.computePartitions(samples);
     auto t1 = std::chrono::high_resolution_clock::now();
     std::cout << "Partitioning took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
     //bp.printSizes();
@@ -178,8 +346,19 @@ int main(int argc, char *argv[])
         std::cout << "Solving seamless..." << std::endl;
         auto t0 = std::chrono::high_resolution_clock::now();
         //Solver().fixSeamsSeparateChannels(m, img_seamless);
-        //Solver().fixSeamsSeparateChannels(m, img_seamless, bp.getPartitions());
-        Solver().fixSeamsSeparateChannels(m, img_seamless, 0.5);
+        //Solver().fixSeamsSeparateChannels(samples, img_seamless, bp.getPartitionSeamIndices());
+        // with --cache=dir the factorization is stored in dir and reused by later runs on the same mesh
+        FactorizationCache cache(namedArgs.count("cache") ? namedArgs["cache"] : std::string());
+        Solver solver(backend);
+        if (namedArgs.count("cache"))
+            solver.setFactorizationCache(&cache);
+        solver.setQuantizedStopping(quantizedStopping);
+        solver.setParallelProducts(parallelProducts);
+        solver.setIncompleteCholeskyFill(icholFill);
+        if (coarseLevels > 0)
+            solver.fixSeamsCoarseToFine(m, samples, img_seamless, 0.5, coarseLevels);
+        else
+            solver.fixSeamsSeparateChannels(samples, img_seamless, 0.5);
         auto t1 = std::chrono::high_resolution_clock::now();
         std::cout << "Optimization took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
 
@@ -203,14 +382,21 @@ int main(int argc, char *argv[])
             std::cout << "Solving seam-aware compression..." << std::endl;
             auto t0 = std::chrono::high_resolution_clock::now();
             CompressedImage cimg;
-            cimg.initialize(img, Image::MaskBit::Seam | Image::MaskBit::Internal);
-            SolverCompressedImage().fixSeamsSeparateChannels(m, img, cimg, 0.5);
-            cimg.quantizeBlocks();
+            cimg.endpointRefinements = endpointRefinements;
+            cimg.initialize(img, Image::MaskBit::Seam | Image::MaskBit::Internal, batchedEncoder);
+            SolverCompressedImage solver(backend);
+            solver.setQuantizedStopping(quantizedStopping);
+            solver.setParallelProducts(parallelProducts);
+            solver.fixSeamsSeparateChannels(samples, img, cimg, 0.5);
             auto t1 = std::chrono::high_resolution_clock::now();
             std::cout << "Optimization took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
             std::string textureOutName = meshName + "_sac.png";
             std::string meshOutName = meshName + "_sac";
             cimg.saveUncompressed(textureOutName.c_str());
+            if (ddsLevels >= 0) {
+                cimg.generateMipmaps(img_seamless, ddsLevels, batchedEncoder);
+                cimg.save((meshName + "_sac.dds").c_str());
+            }
             m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
         }
 
@@ -241,12 +427,16 @@ int main(int argc, char *argv[])
         {
             std::cout << "Compressing seamless texture with PCA..." << std::endl;
             CompressedImage cimg;
-            cimg.initialize(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam);
-            cimg.quantizeBlocks();
+            cimg.endpointRefinements = endpointRefinements;
+            cimg.initialize(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam, batchedEncoder);
 
             std::string textureOutName = meshName + "_sc.png";
             std::string meshOutName = meshName + "_sc";
             cimg.saveUncompressed(textureOutName.c_str());
+            if (ddsLevels >= 0) {
+                cimg.generateMipmaps(img_seamless, ddsLevels, batchedEncoder);
+                cimg.save((meshName + "_sc.dds").c_str());
+            }
             m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
 
         }
@@ -263,6 +453,20 @@ int main(int argc, char *argv[])
             m.saveObjFile(squishMeshName.c_str(), squishTextureName.c_str(), true);
         }
 #endif
+
+        // -- seam-weighted squish compression ---------------------------------
+        if (squishSeamWeight > 0) {
+            std::cout << "Compressing texture with seam-weighted libsquish..." << std::endl;
+            auto t0 = std::chrono::high_resolution_clock::now();
+            Image sc;
+            CompressWithSquish(img, sc, squishSeamWeight);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            std::cout << "Compression took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
+            std::string textureOutName = meshName + "_sqw.png";
+            std::string meshOutName = meshName + "_sqw";
+            sc.save(textureOutName.c_str());
+            m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
+        }
     }
 
     return 0;
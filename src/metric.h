@@ -2,6 +2,7 @@
 #define METRIC_H
 
 #include "image.h"
+#include "compressed_image.h"
 #include <glm/geometric.hpp>
 
 template <typename ImgCmpType2>
@@ -25,4 +26,12 @@ double mse(const Image& i1, const ImgCmpType2& i2, uint8_t bitmask = 0)
     return sum / (double) count;
 }
 
+// decodes the blocks once instead of calling CompressedImage::pixel() per pixel
+inline double mse(const Image& i1, const CompressedImage& i2, uint8_t bitmask = 0)
+{
+    Image decoded;
+    i2.decode(decoded);
+    return mse(i1, decoded, bitmask);
+}
+
 #endif // METRIC_H
@@ -0,0 +1,100 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// the web build only gets threads when it is compiled with -s USE_PTHREADS=1
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define PARALLEL_THREADS 1
+#endif
+
+#ifdef PARALLEL_THREADS
+#include <unsupported/Eigen/CXX11/ThreadPool>
+#endif
+
+static int requestedThreads = 0;
+
+// worker index of the calling thread inside parallelFor(), -1 outside of it
+static thread_local int currentWorker = -1;
+
+void setThreadCount(int n)
+{
+    requestedThreads = std::max(n, 0);
+}
+
+int threadCount()
+{
+#ifndef PARALLEL_THREADS
+    return 1;
+#else
+    if (requestedThreads > 0)
+        return requestedThreads;
+    return std::max(int(std::thread::hardware_concurrency()), 1);
+#endif
+}
+
+#ifdef PARALLEL_THREADS
+static std::mutex poolMutex;
+static std::unique_ptr<Eigen::NonBlockingThreadPool> pool;
+
+// the calling thread works too, so the pool has one thread less than threadCount()
+static Eigen::NonBlockingThreadPool *getPool()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    int n = threadCount() - 1;
+    if (!pool || pool->NumThreads() != n)
+        pool.reset(new Eigen::NonBlockingThreadPool(n));
+    return pool.get();
+}
+#endif
+
+void parallelFor(int n, const std::function<void(int, int)>& f)
+{
+    int nthreads = std::min(threadCount(), n);
+
+    if (nthreads <= 1 || currentWorker != -1) {
+        int worker = std::max(currentWorker, 0);
+        for (int i = 0; i < n; ++i)
+            f(i, worker);
+        return;
+    }
+
+#ifdef PARALLEL_THREADS
+    Eigen::NonBlockingThreadPool *p = getPool();
+
+    std::atomic<int> next(0);
+    auto run = [&](int worker) {
+        currentWorker = worker;
+        for (int i = next++; i < n; i = next++)
+            f(i, worker);
+        currentWorker = -1;
+    };
+
+    std::mutex m;
+    std::condition_variable done;
+    int pending = nthreads - 1;
+
+    for (int worker = 1; worker < nthreads; ++worker) {
+        p->Schedule([&, worker]() {
+            run(worker);
+            std::lock_guard<std::mutex> lock(m);
+            if (--pending == 0)
+                done.notify_one();
+        });
+    }
+
+    run(0);
+
+    std::unique_lock<std::mutex> lock(m);
+    done.wait(lock, [&]() { return pending == 0; });
+#endif
+}
+
+bool inParallelFor()
+{
+    return currentWorker != -1;
+}
@@ -0,0 +1,19 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+// number of threads used by parallelFor(), 0 means one per hardware thread
+void setThreadCount(int n);
+int threadCount();
+
+// calls f(i, worker) for every i in [0, n) and returns when all the calls are done.
+// Indices are handed out in increasing order, so the most expensive work should come first.
+// worker is in [0, threadCount()) and no two concurrent calls get the same one, so it can
+// index per thread scratch data. Nested calls run serially on the calling thread.
+void parallelFor(int n, const std::function<void(int, int)>& f);
+
+// true on the threads running the f of a parallelFor(), where nested calls are serial
+bool inParallelFor();
+
+#endif // PARALLEL_H
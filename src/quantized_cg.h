@@ -0,0 +1,68 @@
+#ifndef QUANTIZED_CG_H
+#define QUANTIZED_CG_H
+
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Core>
+
+// Preconditioned conjugate gradient, as Eigen's ConjugateGradient, that can also stop on the
+// output precision: every checkInterval iterations the variables are compared with the
+// previous check, and the iterations stop once none of them moved by more than halfStep.
+// The results are rounded to steps of 2 * halfStep, so iterating further would only change
+// digits that are thrown away. halfStep <= 0 only stops at the residual tolerance.
+// apply(v, out) computes out = M v; precond.solve(r) approximates M^-1 r.
+// Returns the number of iterations, error gets the relative residual.
+template <typename Apply, typename Preconditioner>
+int conjugateGradientQuantized(const Apply& apply, const Preconditioner& precond, const Eigen::VectorXd& rhs, Eigen::VectorXd& x,
+                               double tolerance, int maxIterations, double halfStep, int checkInterval, double& error)
+{
+    using Eigen::VectorXd;
+
+    const int n = rhs.size();
+
+    double rhsNorm2 = rhs.squaredNorm();
+    if (rhsNorm2 == 0) {
+        x.setZero();
+        error = 0;
+        return 0;
+    }
+    const double threshold = tolerance * tolerance * rhsNorm2;
+
+    VectorXd tmp(n);
+    apply(x, tmp);
+    VectorXd residual = rhs - tmp;
+    double residualNorm2 = residual.squaredNorm();
+
+    VectorXd p = precond.solve(residual);
+    VectorXd z(n);
+    double absNew = residual.dot(p);
+
+    VectorXd xCheck = x;
+
+    int i = 0;
+    while (residualNorm2 >= threshold && i < maxIterations) {
+        apply(p, tmp);
+        double alpha = absNew / p.dot(tmp);
+        x += alpha * p;
+        residual -= alpha * tmp;
+        residualNorm2 = residual.squaredNorm();
+        ++i;
+
+        if (halfStep > 0 && i % checkInterval == 0) {
+            if ((x - xCheck).cwiseAbs().maxCoeff() <= halfStep)
+                break;
+            xCheck = x;
+        }
+
+        z = precond.solve(residual);
+        double absOld = absNew;
+        absNew = residual.dot(z);
+        p = z + (absNew / absOld) * p;
+    }
+
+    error = std::sqrt(residualNorm2 / rhsNorm2);
+    return i;
+}
+
+#endif // QUANTIZED_CG_H
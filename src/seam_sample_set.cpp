@@ -0,0 +1,142 @@
+#include "seam_sample_set.h"
+#include "sampling.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/vec2.hpp>
+
+void SeamSampleSet::build(const Mesh& m, int xres, int yres, Mode sampling)
+{
+    resx = xres;
+    resy = yres;
+    mode = sampling;
+    seam = m.seam;
+
+    if (mode == Mode::Integrated)
+        buildIntegrated(m);
+    else
+        buildPoint(m);
+}
+
+void SeamSampleSet::resizeSamples(int n)
+{
+    for (int side = 0; side < 2; ++side) {
+        for (int corner = 0; corner < 4; ++corner)
+            pixel[side][corner].resize(n);
+        wx[side].resize(n);
+        wy[side].resize(n);
+    }
+}
+
+void SeamSampleSet::setCorners(int side, int k, int x0, int y0, int x1, int y1, float wxk, float wyk)
+{
+    x0 = (x0 + resx) % resx;
+    y0 = (y0 + resy) % resy;
+    x1 = (x1 + resx) % resx;
+    y1 = (y1 + resy) % resy;
+    pixel[side][P00][k] = y0 * resx + x0;
+    pixel[side][P10][k] = y0 * resx + x1;
+    pixel[side][P01][k] = y1 * resx + x0;
+    pixel[side][P11][k] = y1 * resx + x1;
+    wx[side][k] = wxk;
+    wy[side][k] = wyk;
+}
+
+void SeamSampleSet::buildPoint(const Mesh& m)
+{
+    vec2 uvscale(resx, resy);
+
+    weight.clear();
+    pieceSize = 1;
+
+    // count the samples first, so that the seams can be sampled independently
+    std::vector<double> step(seam.size());
+    seamBegin.assign(seam.size() + 1, 0);
+    for (unsigned k = 0; k < seam.size(); ++k) {
+        step[k] = 1 / (SEAM_SAMPLING_FACTOR * m.maxLength(seam[k], uvscale));
+        int n = 0;
+        for (double t = 0; t <= 1; t += step[k])
+            n++;
+        seamBegin[k + 1] = seamBegin[k] + n;
+    }
+
+    resizeSamples(size());
+
+    parallelFor(seam.size(), [&](int k, int) {
+        int i = seamBegin[k];
+        for (double t = 0; t <= 1; t += step[k], ++i) {
+            for (int side = 0; side < 2; ++side) {
+                const Edge& e = (side == 0) ? seam[k].first : seam[k].second;
+                vec2 p0, p1, w;
+                getLinearInterpolationData(m.uvpos(e, t) * uvscale, p0, p1, w);
+                setCorners(side, i, int(p0.x), int(p0.y), int(p1.x), int(p1.y), w.x, w.y);
+            }
+        }
+    });
+}
+
+// 3 point Gauss-Legendre rule on [-1, 1], exact up to degree 5; the squared
+// difference of two bilinear lookups along a segment has degree 4
+static const double gaussNodes[3] = { -0.774596669241483377, 0.0, 0.774596669241483377 };
+static const double gaussWeights[3] = { 5.0 / 9.0, 8.0 / 9.0, 5.0 / 9.0 };
+
+void SeamSampleSet::buildIntegrated(const Mesh& m)
+{
+    dvec2 uvscale(resx, resy);
+
+    pieceSize = 3;
+
+    // the parameters t where either side of a seam enters a new texel cell
+    std::vector<std::vector<double>> breaks(seam.size());
+    parallelFor(seam.size(), [&](int k, int) {
+        std::vector<double>& tv = breaks[k];
+        tv.push_back(0);
+        tv.push_back(1);
+        for (int side = 0; side < 2; ++side) {
+            const Edge& e = (side == 0) ? seam[k].first : seam[k].second;
+            // texel centers lie on integer coordinates of q
+            dvec2 q0 = dvec2(m.vtvec[e.first]) * uvscale - dvec2(0.5);
+            dvec2 q1 = dvec2(m.vtvec[e.second]) * uvscale - dvec2(0.5);
+            for (int c = 0; c < 2; ++c) {
+                double lo = std::min(q0[c], q1[c]);
+                double hi = std::max(q0[c], q1[c]);
+                for (double g = std::floor(lo) + 1; g < hi; g += 1)
+                    tv.push_back((g - q0[c]) / (q1[c] - q0[c]));
+            }
+        }
+        std::sort(tv.begin(), tv.end());
+        tv.erase(std::unique(tv.begin(), tv.end()), tv.end());
+    });
+
+    seamBegin.assign(seam.size() + 1, 0);
+    for (unsigned k = 0; k < seam.size(); ++k)
+        seamBegin[k + 1] = seamBegin[k] + pieceSize * (breaks[k].size() - 1);
+
+    resizeSamples(size());
+    weight.resize(size());
+
+    parallelFor(seam.size(), [&](int k, int) {
+        // the integral runs over the length of the longer side, so that a seam gets
+        // roughly the weight of its point samples divided by SEAM_SAMPLING_FACTOR
+        double d = m.maxLength(seam[k], vec2(resx, resy));
+        int i = seamBegin[k];
+        for (unsigned j = 0; j + 1 < breaks[k].size(); ++j) {
+            double mid = (breaks[k][j] + breaks[k][j+1]) / 2;
+            double half = (breaks[k][j+1] - breaks[k][j]) / 2;
+            for (int g = 0; g < 3; ++g, ++i) {
+                double t = mid + half * gaussNodes[g];
+                // squared by the least squares, so the equation gets the square root of the quadrature weight
+                weight[i] = std::sqrt(d * half * gaussWeights[g]);
+                for (int side = 0; side < 2; ++side) {
+                    const Edge& e = (side == 0) ? seam[k].first : seam[k].second;
+                    dvec2 q = glm::mix(dvec2(m.vtvec[e.first]), dvec2(m.vtvec[e.second]), t) * uvscale - dvec2(0.5);
+                    dvec2 q0 = glm::floor(q);
+                    dvec2 w = q - q0;
+                    setCorners(side, i, int(q0.x), int(q0.y), int(q0.x) + 1, int(q0.y) + 1, float(w.x), float(w.y));
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,70 @@
+#ifndef SEAM_SAMPLE_SET_H
+#define SEAM_SAMPLE_SET_H
+
+#include <vector>
+
+#include "mesh.h"
+
+// The samples taken along the seams of a mesh at a given texture resolution.
+// A sample has two sides, one per edge of the seam, and each side is the bilinear
+// lookup of 4 pixels. Every component is stored in its own array, indexed by sample.
+class SeamSampleSet
+{
+public:
+
+    enum Corner { P00 = 0, P10, P01, P11 };
+
+    enum class Mode {
+        // point samples 1/(SEAM_SAMPLING_FACTOR * length) apart along the seam
+        Point,
+        // the seam is split where either side crosses the texel grid, so that the squared
+        // difference of the two sides is a polynomial on each piece, and its integral is
+        // sampled exactly at the Gauss points of the piece
+        Integrated
+    };
+
+    Mode mode = Mode::Point;
+
+    int resx = 0;
+    int resy = 0;
+
+    std::vector<Seam> seam; // same as Mesh::seam
+
+    // the samples of seam k are [seamBegin[k], seamBegin[k+1])
+    std::vector<int> seamBegin;
+
+    // wrapped index y * resx + x of the corner pixels of each side
+    std::vector<int> pixel[2][4];
+
+    // interpolation weights of each side, P00 has weight (1 - wx) * (1 - wy)
+    std::vector<float> wx[2];
+    std::vector<float> wy[2];
+
+    // Integrated only: the weight of the equation of each sample, and the number of
+    // consecutive samples (Gauss points) making up a piece
+    std::vector<double> weight;
+    int pieceSize = 1;
+
+    SeamSampleSet() {}
+    SeamSampleSet(const Mesh& m, int xres, int yres, Mode sampling = Mode::Point) { build(m, xres, yres, sampling); }
+
+    void build(const Mesh& m, int xres, int yres, Mode sampling = Mode::Point);
+
+    int size() const { return seamBegin.empty() ? 0 : seamBegin.back(); }
+    int numSeams() const { return seam.size(); }
+
+    double weightOf(int k) const { return weight.empty() ? 1.0 : weight[k]; }
+
+    int pixelX(int side, int corner, int k) const { return pixel[side][corner][k] % resx; }
+    int pixelY(int side, int corner, int k) const { return pixel[side][corner][k] / resx; }
+
+private:
+
+    void resizeSamples(int n);
+    void setCorners(int side, int k, int x0, int y0, int x1, int y1, float wxk, float wyk);
+
+    void buildPoint(const Mesh& m);
+    void buildIntegrated(const Mesh& m);
+};
+
+#endif // SEAM_SAMPLE_SET_H
@@ -0,0 +1,156 @@
+#include "seam_stencil.h"
+#include "seam_sample_set.h"
+#include "variable_map.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// rows (or variables) per parallelFor() index
+static const int CHUNK = 4096;
+
+// sum of w[i] * v[idx[i]] for i in [0, n)
+static inline double gatherDot(const int *idx, const float *w, int n, const double *v)
+{
+    int i = 0;
+    double s = 0;
+#ifdef __AVX2__
+    __m256d acc = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256d g = _mm256_i32gather_pd(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx + i)), 8);
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(w + i)), g));
+    }
+    __m128d h = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    s = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+#endif
+    for (; i < n; ++i)
+        s += w[i] * v[idx[i]];
+    return s;
+}
+
+void SeamStencil::build(const SeamSampleSet& samples, double alpha, VariableMap& vi)
+{
+    const int n = samples.size();
+    int nvar = 0;
+
+    index.resize(size_t(n) * WIDTH);
+    coef.resize(size_t(n) * WIDTH);
+
+    for (int k = 0; k < n; ++k) {
+        double s = alpha * samples.weightOf(k);
+        for (int side = 0; side < 2; ++side) {
+            double wx = samples.wx[side][k];
+            double wy = samples.wy[side][k];
+            double cw[4] = { (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy }; // same order as SeamSampleSet::Corner
+            for (int corner = 0; corner < 4; ++corner) {
+                int x = samples.pixelX(side, corner, k);
+                int y = samples.pixelY(side, corner, k);
+                int v = vi.find(x, y);
+                if (v == -1) {
+                    v = nvar++;
+                    vi.insert(x, y, v);
+                }
+                index[size_t(k) * WIDTH + side * 4 + corner] = v;
+                coef[size_t(k) * WIDTH + side * 4 + corner] = float((side == 0) ? s * cw[corner] : -s * cw[corner]);
+            }
+        }
+    }
+
+    diag.assign(nvar, 0);
+
+    // transpose, the entries of a variable are in row order
+    colBegin.assign(nvar + 1, 0);
+    for (int v : index)
+        colBegin[v + 1]++;
+    for (int v = 0; v < nvar; ++v)
+        colBegin[v + 1] += colBegin[v];
+    colRow.resize(index.size());
+    colCoef.resize(index.size());
+    std::vector<int> fill(colBegin.begin(), colBegin.end() - 1);
+    for (size_t e = 0; e < index.size(); ++e) {
+        int pos = fill[index[e]]++;
+        colRow[pos] = e / WIDTH;
+        colCoef[pos] = coef[e];
+    }
+
+    // a variable can appear more than once in a row, its coefficients add up before squaring
+    seamDiag.assign(nvar, 0);
+    for (int k = 0; k < n; ++k) {
+        const int *idx = &index[size_t(k) * WIDTH];
+        const float *c = &coef[size_t(k) * WIDTH];
+        for (int j = 0; j < WIDTH; ++j) {
+            bool first = true;
+            for (int i = 0; i < j; ++i)
+                first = first && (idx[i] != idx[j]);
+            if (!first)
+                continue;
+            double cv = 0;
+            for (int i = j; i < WIDTH; ++i)
+                if (idx[i] == idx[j])
+                    cv += c[i];
+            seamDiag[idx[j]] += cv * cv;
+        }
+    }
+
+    ax.resize(n);
+}
+
+size_t SeamStencil::memoryUsage() const
+{
+    return index.size() * sizeof(int) + coef.size() * sizeof(float)
+         + colBegin.size() * sizeof(int) + colRow.size() * sizeof(int) + colCoef.size() * sizeof(float)
+         + (seamDiag.size() + diag.size() + ax.size()) * sizeof(double);
+}
+
+void SeamStencil::apply(const double *x, double *y) const
+{
+    const int n = numSamples();
+    const int nvar = rows();
+
+    // A x, one gather per row
+    parallelFor((n + CHUNK - 1) / CHUNK, [&](int c, int) {
+        int end = std::min(n, (c + 1) * CHUNK);
+        for (int k = c * CHUNK; k < end; ++k)
+            ax[k] = gatherDot(&index[size_t(k) * WIDTH], &coef[size_t(k) * WIDTH], WIDTH, x);
+    });
+
+    // A^T (A x) + diag x, one gather per variable
+    parallelFor((nvar + CHUNK - 1) / CHUNK, [&](int c, int) {
+        int end = std::min(nvar, (c + 1) * CHUNK);
+        for (int v = c * CHUNK; v < end; ++v) {
+            int b = colBegin[v];
+            y[v] = diag[v] * x[v] + gatherDot(&colRow[b], &colCoef[b], colBegin[v + 1] - b, ax.data());
+        }
+    });
+}
+
+Eigen::VectorXd SeamStencil::diagonal() const
+{
+    Eigen::VectorXd d(rows());
+    for (int v = 0; v < rows(); ++v)
+        d[v] = seamDiag[v] + diag[v];
+    return d;
+}
+
+double SeamStencil::seamError(const double *x) const
+{
+    const int n = numSamples();
+
+    // summed per chunk and then in order, so that the result does not depend on the threads
+    std::vector<double> partial((n + CHUNK - 1) / CHUNK, 0);
+    parallelFor(partial.size(), [&](int c, int) {
+        int end = std::min(n, (c + 1) * CHUNK);
+        for (int k = c * CHUNK; k < end; ++k) {
+            double r = gatherDot(&index[size_t(k) * WIDTH], &coef[size_t(k) * WIDTH], WIDTH, x);
+            partial[c] += r * r;
+        }
+    });
+
+    double err = 0;
+    for (double p : partial)
+        err += p;
+    return err;
+}
@@ -0,0 +1,127 @@
+#ifndef SEAM_STENCIL_H
+#define SEAM_STENCIL_H
+
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+class SeamSampleSet;
+class VariableMap;
+class SeamStencil;
+
+namespace Eigen {
+namespace internal {
+    // SeamStencil is a sparse (self adjoint) operator as far as the iterative solvers are concerned
+    template<>
+    struct traits<SeamStencil> : public traits<SparseMatrix<double>> {};
+}
+}
+
+// The normal matrix A^T A of the seam equations plus a diagonal term, applied without
+// ever being assembled. Every seam sample is one row of A, the difference of the bilinear
+// lookups of its two sides, stored as WIDTH variable indices and WIDTH coefficients.
+// The rows are also stored transposed, per variable, so that A^T can be applied in
+// parallel without two threads writing the same variable. Memory is O(samples).
+class SeamStencil : public Eigen::EigenBase<SeamStencil>
+{
+public:
+
+    typedef double Scalar;
+    typedef double RealScalar;
+    typedef int StorageIndex;
+    enum {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+    };
+
+    static constexpr int WIDTH = 8; // 4 corners per side
+
+    // maps the corner pixels of the samples to variables (in vi) and builds the rows,
+    // weighted by alpha and the sample weights; diag is then sized to the variables
+    void build(const SeamSampleSet& samples, double alpha, VariableMap& vi);
+
+    // the diagonal term, e.g. the squared weights of identity equations
+    std::vector<double> diag;
+
+    Eigen::Index rows() const { return diag.size(); }
+    Eigen::Index cols() const { return diag.size(); }
+
+    int numSamples() const { return index.size() / WIDTH; }
+    size_t memoryUsage() const; // bytes
+
+    // y = (A^T A + diag) x, with multiple threads
+    void apply(const double *x, double *y) const;
+
+    // (A^T A + diag) x for CG
+    template<typename Rhs>
+    Eigen::Product<SeamStencil, Rhs, Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs>& x) const
+    {
+        return Eigen::Product<SeamStencil, Rhs, Eigen::AliasFreeProduct>(*this, x.derived());
+    }
+
+    // diagonal of A^T A + diag
+    Eigen::VectorXd diagonal() const;
+
+    // |A x|^2
+    double seamError(const double *x) const;
+
+private:
+
+    // the rows of A
+    std::vector<int> index;
+    std::vector<float> coef;
+
+    // A^T: the entries of variable v are [colBegin[v], colBegin[v+1]), each refers to a row
+    std::vector<int> colBegin;
+    std::vector<int> colRow;
+    std::vector<float> colCoef;
+
+    std::vector<double> seamDiag; // diagonal of A^T A
+
+    mutable std::vector<double> ax; // A x, scratch of apply()
+};
+
+// Jacobi preconditioner for ConjugateGradient<SeamStencil, ...>
+class SeamStencilPreconditioner
+{
+    Eigen::VectorXd invDiag;
+
+public:
+
+    SeamStencilPreconditioner() {}
+
+    SeamStencilPreconditioner& analyzePattern(const SeamStencil&) { return *this; }
+    SeamStencilPreconditioner& factorize(const SeamStencil& op) { invDiag = op.diagonal().cwiseInverse(); return *this; }
+    SeamStencilPreconditioner& compute(const SeamStencil& op) { return factorize(op); }
+
+    template<typename Rhs>
+    Eigen::VectorXd solve(const Eigen::MatrixBase<Rhs>& b) const { return invDiag.cwiseProduct(b); }
+
+    Eigen::ComputationInfo info() { return Eigen::Success; }
+};
+
+namespace Eigen {
+namespace internal {
+
+    template<typename Rhs>
+    struct generic_product_impl<SeamStencil, Rhs, SparseShape, DenseShape, GemvProduct>
+        : generic_product_impl_base<SeamStencil, Rhs, generic_product_impl<SeamStencil, Rhs>>
+    {
+        typedef typename Product<SeamStencil, Rhs>::Scalar Scalar;
+
+        template<typename Dest>
+        static void scaleAndAddTo(Dest& dst, const SeamStencil& lhs, const Rhs& rhs, const Scalar& alpha)
+        {
+            VectorXd x = rhs;
+            VectorXd y(lhs.rows());
+            lhs.apply(x.data(), y.data());
+            dst += alpha * y;
+        }
+    };
+
+}
+}
+
+#endif // SEAM_STENCIL_H
@@ -2,50 +2,67 @@
 
 #include "solver.h"
 #include "image.h"
+#include "parallel.h"
+#include "seam_sample_set.h"
+#include "factorization_cache.h"
+#include "seam_stencil.h"
+#include "quantized_cg.h"
 
+#include <algorithm>
 #include <memory>
+#include <chrono>
+#include <map>
+#include <numeric>
+#include <sstream>
+
+#include <Eigen/IterativeLinearSolvers>
 
 
 // -- Solver -------------------------------------------------------------------
 
-Solver::Solver()
+Solver::Solver(SolverBackend backend)
 {
+    // unless the backend iterates on A itself only A^T A is accumulated, the rows are never stored
+    sys.setBackend(backend);
+}
 
+void Solver::setQuantizedStopping(bool enable)
+{
+    // the output is rounded to 8 bits
+    std::fill(sys.quantizationStep, sys.quantizationStep + 3, enable ? 1.0 : 0.0);
 }
 
 void Solver::fixSeams(const Mesh& m, Image& img)
+{
+    fixSeams(SeamSampleSet(m, img.resx, img.resy), img);
+}
+
+void Solver::fixSeams(const SeamSampleSet& samples, Image& img)
 {
     resx = img.resx;
     resy = img.resy;
 
-    vi.clear();
-    vi.resize(resx * resy, -1);
+    vi.reset(resx, resy);
 
     sys.clear();
 
-    vec2 uvscale(resx, resy);
-
     // be seamless
-    for (const Seam& s : m.seam) {
-        double d = m.maxLength(s, uvscale);
-        for (double t = 0; t <= 1; t += 1 / (2*d)) {
-            sys.addEquation(
-                pixel(m.uvpos(s.first, t) * uvscale) == pixel(m.uvpos(s.second, t) * uvscale)
-            );
-        }
+    for (int k = 0; k < samples.size(); ++k) {
+        sys.addEquation(
+            samples.weightOf(k) * (sample(samples, k, 0) == sample(samples, k, 1))
+        );
     }
 
     sys.printShort();
     // be yourself
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        if (vi[indexOf(x, y)] != -1) {
-            double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
-            //double w = 0.01;
-            sys.addEquation(w * (
-                pixel(x, y) == img.pixel(x, y)
-            ));
-        }
+    for (int i : vi.touchedCells()) {
+        int x = i % resx;
+        int y = i / resx;
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+        //double w = 0.01;
+        sys.addEquation(w * (
+            pixel(x, y) == img.pixel(x, y)
+        ));
     }
 
     sys.printShort();
@@ -58,72 +75,282 @@ void Solver::fixSeams(const Mesh& m, Image& img)
 
     std::cout << "error " << e1 << " -> " << e2 << std::endl;
 
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        if (vi[indexOf(x, y)] != -1) {
-            img.pixel(x, y) = glm::clamp(pixel(x, y).evaluateFor(vars), vec3(0), vec3(255));
-        }
+    for (int i : vi.touchedCells()) {
+        int x = i % resx;
+        int y = i / resx;
+        img.pixel(x, y) = glm::clamp(pixel(x, y).evaluateFor(vars), vec3(0), vec3(255));
     }
 }
 
 void Solver::fixSeamsSeparateChannels(const Mesh& m, Image& img, double alpha)
+{
+    fixSeamsSeparateChannels(SeamSampleSet(m, img.resx, img.resy), img, alpha);
+}
+
+void Solver::fixSeamsSeparateChannels(const SeamSampleSet& samples, Image& img, double alpha)
 {
     resx = img.resx;
     resy = img.resy;
 
-    vec2 uvscale(resx, resy);
-
     assert(alpha >= 0);
     assert(alpha <= 1);
 
     double err_seamless = 0;
     double err_id = 0;
 
+    if (sys.backend == SolverBackend::CG_MATRIX_FREE) {
+        solveMatrixFree(samples, img, alpha);
+        return;
+    }
+
+    bool cacheable = cache && (sys.backend == SolverBackend::LDLT_AMD || sys.backend == SolverBackend::LDLT_COLAMD);
+    uint64_t cacheKey = 0;
+    if (cacheable) {
+        cacheKey = FactorizationCache::key(samples, img, alpha);
+        std::shared_ptr<const CachedSeamSystem> entry = cache->find(cacheKey, resx, resy, alpha);
+        if (entry) {
+            solveCached(*entry, img);
+            return;
+        }
+    }
+
+    vi.reset(resx, resy);
+
+    sys.clear();
+
+    const int seamlessEqs = sys.group("seamless");
+    const int idEqs = sys.group("id");
+
+    // be seamless
+    addSeamEquations(samples, 0, samples.size(), alpha, seamlessEqs);
+
+    // be yourself
+    addIdentityEquations(img, alpha, idEqs);
+
+    sys.printShort();
+
+    std::cout << "Solving for 3 channels" << std::endl;
+
+    std::vector<std::vector<scalar>> vars;
+    sys.keepFactors = cacheable;
+    sys.solve(vars);
+    sys.keepFactors = false;
+
+    if (sys.factors) {
+        std::shared_ptr<CachedSeamSystem> entry = std::make_shared<CachedSeamSystem>();
+        entry->resx = resx;
+        entry->resy = resy;
+        entry->alpha = alpha;
+        entry->pixels = vi.touchedCells();
+        for (int i : entry->pixels) {
+            double w = (img.mask(i % resx, i / resx) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+            entry->idWeight.push_back(((1 - alpha) * w) * ((1 - alpha) * w));
+        }
+        entry->factors = *sys.factors;
+        cache->insert(cacheKey, entry);
+    }
+
     for (int channel = 0; channel < 3; ++channel) {
-        std::cout << "Solving for channel " << channel << std::endl;
+        err_seamless += sys.squaredErrorFor(vars[channel], seamlessEqs, channel);
+        err_id += sys.squaredErrorFor(vars[channel], idEqs, channel);
+
+        for (int i : vi.touchedCells()) {
+            int x = i % resx;
+            int y = i / resx;
+            img.pixel(x, y)[channel] = glm::clamp(vars[channel][vi.find(x, y)], 0.0, 255.0);
+        }
+    }
+
+    std::cout << "Error (seamless) = " << err_seamless << std::endl;
+    std::cout << "Error (id)       = " << err_id << std::endl;
+    std::cout << "Error (total)    = " << err_seamless + err_id << std::endl;
+}
+
+// box filtered copy of img at half the resolution, with the internal mask of m
+static Image halve(const Image& img, const Mesh& m)
+{
+    Image half;
+    half.resize(img.resx / 2, img.resy / 2);
+    for (int y = 0; y < half.resy; ++y) {
+        for (int x = 0; x < half.resx; ++x) {
+            half.pixel(x, y) = 0.25f * (img.pixel(2*x, 2*y) + img.pixel(2*x + 1, 2*y)
+                                      + img.pixel(2*x, 2*y + 1) + img.pixel(2*x + 1, 2*y + 1));
+        }
+    }
+    half.setMaskInternal(m);
+    return half;
+}
+
+// bilinear lookup of the cx x cy field at the center of pixel (x, y) of the level above
+static dvec3 prolongate(const std::vector<dvec3>& field, int cx, int cy, int x, int y)
+{
+    double u = (x + 0.5) / 2 - 0.5;
+    double v = (y + 0.5) / 2 - 0.5;
+    int x0 = int(std::floor(u));
+    int y0 = int(std::floor(v));
+    double wx = u - x0;
+    double wy = v - y0;
+    auto at = [&](int i, int j) { return field[((j + cy) % cy) * cx + (i + cx) % cx]; };
+    return glm::mix(glm::mix(at(x0, y0), at(x0 + 1, y0), wx),
+                    glm::mix(at(x0, y0 + 1), at(x0 + 1, y0 + 1), wx), wy);
+}
+
+void Solver::fixSeamsCoarseToFine(const Mesh& m, const SeamSampleSet& samples, Image& img, double alpha, int levels)
+{
+    assert(alpha >= 0);
+    assert(alpha <= 1);
+
+    // the direct backends ignore the guess, the coarse levels would only cost time
+    if (!solverBackendIsIterative(sys.backend))
+        levels = 0;
+
+    // every level halves the resolution
+    while (levels > 0 && (img.resx % (1 << levels) != 0 || img.resy % (1 << levels) != 0
+                          || (img.resx >> levels) < 16 || (img.resy >> levels) < 16))
+        levels--;
+
+    // coarse[l-1] is level l
+    std::vector<Image> coarse(levels);
+    for (int l = 0; l < levels; ++l)
+        coarse[l] = halve((l == 0) ? img : coarse[l-1], m);
+
+    // solution - texture of the previous level at its variables, 0 elsewhere
+    std::vector<dvec3> correction;
+    int cx = 0;
+    int cy = 0;
 
-        vi.clear();
-        vi.resize(resx * resy, -1);
+    for (int l = levels; l >= 0; --l) {
+        Image& level = (l == 0) ? img : coarse[l-1];
+        resx = level.resx;
+        resy = level.resy;
+
+        SeamSampleSet levelSamples;
+        if (l > 0)
+            levelSamples.build(m, resx, resy, samples.mode);
+        const SeamSampleSet& s = (l == 0) ? samples : levelSamples;
+
+        vi.reset(resx, resy);
 
         sys.clear();
 
-        // be seamless
-        for (const Seam& s : m.seam) {
-            double d = m.maxLength(s, uvscale);
-            for (double t = 0; t <= 1; t += 1 / (2*d)) {
-                sys.addEquation(
-                    alpha * (pixelExp(m.uvpos(s.first, t) * uvscale) == pixelExp(m.uvpos(s.second, t) * uvscale)), "seamless"
-                );
+        const int seamlessEqs = sys.group("seamless");
+        const int idEqs = sys.group("id");
+
+        addSeamEquations(s, 0, s.size(), alpha, seamlessEqs);
+        addIdentityEquations(level, alpha, idEqs);
+
+        // the texture plus the prolongated correction is the initial guess of the iterative backends
+        std::vector<std::vector<scalar>> vars(3, std::vector<scalar>(sys.nvar));
+        for (int i : vi.touchedCells()) {
+            int x = i % resx;
+            int y = i / resx;
+            dvec3 guess = dvec3(level.pixel(x, y));
+            if (l < levels)
+                guess += prolongate(correction, cx, cy, x, y);
+            for (int channel = 0; channel < 3; ++channel)
+                vars[channel][vi.find(x, y)] = guess[channel];
+        }
+
+        sys.solve(vars);
+
+        std::cout << "Level " << l << " (" << resx << "x" << resy << "): " << sys.nvar << " variables, #iterations = "
+                  << sys.stats.iterations << std::endl;
+
+        if (l > 0) {
+            cx = resx;
+            cy = resy;
+            correction.assign(size_t(cx) * cy, dvec3(0));
+            for (int i : vi.touchedCells()) {
+                int v = vi.find(i % resx, i / resx);
+                correction[i] = dvec3(vars[0][v], vars[1][v], vars[2][v]) - dvec3(level.pixel(i % resx, i / resx));
             }
+            continue;
         }
 
-        // be yourself
-        for (int y = 0; y < resy; ++y)
-        for (int x = 0; x < resx; ++x) {
-            if (vi[indexOf(x, y)] != -1) {
-                double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
-                //double w = 0.01;
-                sys.addEquation(
-                    (1 - alpha) * (w * (pixelExp(x, y) == img.pixel(x, y)[channel])), "id"
-                );
+        double err_seamless = 0;
+        double err_id = 0;
+        for (int channel = 0; channel < 3; ++channel) {
+            err_seamless += sys.squaredErrorFor(vars[channel], seamlessEqs, channel);
+            err_id += sys.squaredErrorFor(vars[channel], idEqs, channel);
+
+            for (int i : vi.touchedCells()) {
+                int x = i % resx;
+                int y = i / resx;
+                img.pixel(x, y)[channel] = glm::clamp(vars[channel][vi.find(x, y)], 0.0, 255.0);
             }
         }
 
-        sys.printShort();
+        std::cout << "Error (seamless) = " << err_seamless << std::endl;
+        std::cout << "Error (id)       = " << err_id << std::endl;
+        std::cout << "Error (total)    = " << err_seamless + err_id << std::endl;
+    }
+}
 
-        std::vector<scalar> vars;
-        sys.initializeVars(vars);
+void Solver::solveMatrixFree(const SeamSampleSet& samples, Image& img, double alpha)
+{
+    vi.reset(resx, resy);
 
-        sys.solve(vars);
+    // be seamless
+    SeamStencil op;
+    op.build(samples, alpha, vi);
+
+    // be yourself, the identity equations only add to the diagonal and to A^T b.
+    // Variables are numbered in the order their pixels are touched
+    const int n = op.rows();
+    const std::vector<int>& pixels = vi.touchedCells();
+    Eigen::MatrixXd x(n, 3);
+    Eigen::MatrixXd Atb(n, 3);
+    for (int v = 0; v < n; ++v) {
+        int px = pixels[v] % resx;
+        int py = pixels[v] / resx;
+        double w = (img.mask(px, py) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+        op.diag[v] = ((1 - alpha) * w) * ((1 - alpha) * w);
+        vec3 p = img.pixel(px, py);
+        for (int channel = 0; channel < 3; ++channel) {
+            x(v, channel) = p[channel]; // the source texture is the initial guess
+            Atb(v, channel) = op.diag[v] * p[channel];
+        }
+    }
 
-        err_seamless += sys.squaredErrorFor(vars, "seamless");
-        err_id += sys.squaredErrorFor(vars, "id");
+    std::cout << "Solving for 3 channels" << std::endl;
 
-        for (int y = 0; y < resy; ++y)
-        for (int x = 0; x < resx; ++x) {
-            if (vi[indexOf(x, y)] != -1) {
-                img.pixel(x, y)[channel] = glm::clamp(pixelExp(x, y).evaluateFor(vars), 0.0, 255.0);
-            }
+    Eigen::ConjugateGradient<SeamStencil, Eigen::Lower | Eigen::Upper, SeamStencilPreconditioner> cg;
+    cg.setTolerance(1e-14);
+    cg.compute(op);
+
+    sys.stats = SolverStats();
+    sys.stats.backend = SolverBackend::CG_MATRIX_FREE;
+    auto apply = [&op](const Eigen::VectorXd& v, Eigen::VectorXd& out) { op.apply(v.data(), out.data()); };
+    for (int channel = 0; channel < 3; ++channel) {
+        if (sys.quantizationStep[channel] > 0) {
+            Eigen::VectorXd xc = x.col(channel);
+            double error = 0;
+            sys.stats.iterations += conjugateGradientQuantized(apply, cg.preconditioner(), Eigen::VectorXd(Atb.col(channel)), xc, 1e-14, 2 * n,
+                                                               0.5 * sys.quantizationStep[channel], sys.checkInterval, error);
+            sys.stats.error = std::max(sys.stats.error, error);
+            x.col(channel) = xc;
+        } else {
+            x.col(channel) = cg.solveWithGuess(Atb.col(channel), x.col(channel));
+            sys.stats.iterations += cg.iterations();
+            sys.stats.error = std::max(sys.stats.error, double(cg.error()));
+        }
+    }
+
+    if (sys.verbose) {
+        std::cout << solverBackendName(SolverBackend::CG_MATRIX_FREE) << ": " << op.numSamples() << " seam samples, "
+                  << n << " variables in " << op.memoryUsage() / (1024.0 * 1024.0) << " MB, #iterations = "
+                  << sys.stats.iterations << ", estimated error = " << sys.stats.error << std::endl;
+    }
+
+    double err_seamless = 0;
+    double err_id = 0;
+    for (int channel = 0; channel < 3; ++channel) {
+        err_seamless += op.seamError(x.col(channel).data());
+        for (int v = 0; v < n; ++v) {
+            vec3& p = img.pixel(pixels[v] % resx, pixels[v] / resx);
+            double d = x(v, channel) - p[channel];
+            err_id += op.diag[v] * d * d;
+            p[channel] = glm::clamp(x(v, channel), 0.0, 255.0);
         }
     }
 
@@ -132,71 +359,351 @@ void Solver::fixSeamsSeparateChannels(const Mesh& m, Image& img, double alpha)
     std::cout << "Error (total)    = " << err_seamless + err_id << std::endl;
 }
 
+void Solver::solveCached(const CachedSeamSystem& entry, Image& img)
+{
+    // the seam equations have no constant term, so A^T b only has the identity part
+    const int n = entry.pixels.size();
+    Eigen::MatrixXd x(n, 3);
+    for (int v = 0; v < n; ++v) {
+        const vec3& p = img.pixel(entry.pixels[v] % resx, entry.pixels[v] / resx);
+        for (int channel = 0; channel < 3; ++channel)
+            x(v, channel) = entry.idWeight[v] * p[channel];
+    }
+
+    std::cout << "Solving for 3 channels with the cached factorization (" << n << " variables)" << std::endl;
+
+    entry.factors.solveInPlace(x);
+
+    double err_id = 0;
+    for (int v = 0; v < n; ++v) {
+        vec3& p = img.pixel(entry.pixels[v] % resx, entry.pixels[v] / resx);
+        for (int channel = 0; channel < 3; ++channel) {
+            double d = x(v, channel) - p[channel];
+            err_id += entry.idWeight[v] * d * d;
+            p[channel] = glm::clamp(x(v, channel), 0.0, 255.0);
+        }
+    }
+
+    std::cout << "Error (id)       = " << err_id << std::endl;
+}
+
 void Solver::fixSeamsSeparateChannels(const Mesh& m, Image& img, const std::vector<std::vector<Seam>>& vsv)
+{
+    SeamSampleSet samples(m, img.resx, img.resy);
+
+    std::map<Seam, int> seamIndex;
+    for (int k = 0; k < samples.numSeams(); ++k)
+        seamIndex[samples.seam[k]] = k;
+
+    std::vector<std::vector<int>> partitions;
+    for (const std::vector<Seam>& sv : vsv) {
+        partitions.push_back(std::vector<int>());
+        for (const Seam& s : sv)
+            partitions.back().push_back(seamIndex.at(s));
+    }
+
+    fixSeamsSeparateChannels(samples, img, partitions);
+}
+
+void Solver::fixSeamsSeparateChannels(const SeamSampleSet& samples, Image& img, const std::vector<std::vector<int>>& partitions)
 {
     resx = img.resx;
     resy = img.resy;
 
-    vec2 uvscale(resx, resy);
+    // partitions share no pixels, so they are solved concurrently, the largest (most seam samples) first
+    std::vector<int> cost(partitions.size(), 0);
+    for (unsigned k = 0; k < partitions.size(); ++k) {
+        for (int s : partitions[k])
+            cost[k] += samples.seamBegin[s+1] - samples.seamBegin[s];
+    }
+    std::vector<int> order(partitions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&cost](int k1, int k2) { return cost[k1] > cost[k2]; });
+
+    // every worker has its own equations and variable map
+    std::vector<Solver> workers(threadCount());
+    for (Solver& worker : workers) {
+        worker.configureLike(*this);
+        worker.resx = resx;
+        worker.resy = resy;
+        worker.sys.verbose = false;
+    }
+
+    // the new pixel values are written back once all the partitions are solved, as other
+    // workers may still be reading the image
+    std::vector<std::vector<std::pair<int, vec3>>> solved(partitions.size());
+    std::vector<double> parterr(partitions.size(), 0);
+
+    parallelFor(order.size(), [&](int i, int w) {
+        int k = order[i];
+        parterr[k] = workers[w].solvePartition(samples, img, partitions[k], solved[k]);
+    });
 
     double toterr = 0;
-    for (const std::vector<Seam>& sv : vsv) {
-        std::cout << "Solving partition of " << sv.size() << " seams" << std::endl;
-        double parterr = 0;
-        for (int channel = 0; channel < 3; ++channel) {
+    for (unsigned k = 0; k < partitions.size(); ++k) {
+        std::cout << "Partition of " << partitions[k].size() << " seams, " << solved[k].size() << " pixels, error = " << parterr[k] << std::endl;
+        for (const auto& entry : solved[k])
+            img.pixel(entry.first % resx, entry.first / resx) = entry.second;
+        toterr += parterr[k];
+    }
+    std::cout << "Total error = " << toterr << std::endl;
+}
 
-            vi.clear();
-            vi.resize(resx * resy, -1);
+void Solver::configureLike(const Solver& other)
+{
+    sys.setBackend(other.sys.backend);
+    std::copy(other.sys.quantizationStep, other.sys.quantizationStep + 3, sys.quantizationStep);
+    sys.checkInterval = other.sys.checkInterval;
+    sys.icholFill = other.sys.icholFill;
+    sys.blockJacobiSize = other.sys.blockJacobiSize;
+    sys.parallelProducts = other.sys.parallelProducts;
+    sys.verbose = other.sys.verbose;
+    cache = other.cache;
+}
 
-            sys.clear();
+double Solver::solvePartition(const SeamSampleSet& samples, const Image& img, const std::vector<int>& seams, std::vector<std::pair<int, vec3>>& out)
+{
+    vi.reset(resx, resy);
 
-            // be seamless
-            for (const Seam& s : sv) {
-                double d = m.maxLength(s, uvscale);
-                for (double t = 0; t <= 1; t += 1 / (2*d)) {
-                    sys.addEquation(
-                        pixelExp(m.uvpos(s.first, t) * uvscale) == pixelExp(m.uvpos(s.second, t) * uvscale)
-                    );
-                }
-            }
+    sys.clear();
 
-            sys.printShort();
-
-            // be yourself
-            for (int y = 0; y < resy; ++y)
-            for (int x = 0; x < resx; ++x) {
-                if (vi[indexOf(x, y)] != -1) {
-                    double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
-                    //double w = 0.01;
-                    sys.addEquation(w * (
-                        pixelExp(x, y) == img.pixel(x, y)[channel]
-                    ));
-                }
-            }
+    const int seamlessEqs = sys.group("seamless");
+    const int idEqs = sys.group("id");
 
-            sys.printShort();
+    // be seamless
+    for (int s : seams)
+        addSeamEquations(samples, samples.seamBegin[s], samples.seamBegin[s+1], 1.0, seamlessEqs);
 
-            std::vector<scalar> vars;
-            sys.initializeVars(vars);
+    // be yourself
+    for (int i : vi.touchedCells()) {
+        int x = i % resx;
+        int y = i / resx;
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+        sys.addEquation(w * pixelExp(x, y), w * dvec3(img.pixel(x, y)), idEqs);
+    }
 
-            sys.solve(vars);
-            double err = sys.squaredErrorFor(vars);
-            parterr += err;
+    std::vector<std::vector<scalar>> vars;
+    sys.solve(vars);
 
-            for (int y = 0; y < resy; ++y)
-            for (int x = 0; x < resx; ++x) {
-                if (vi[indexOf(x, y)] != -1) {
-                    img.pixel(x, y)[channel] = glm::clamp(pixelExp(x, y).evaluateFor(vars), 0.0, 255.0);
+    double err = 0;
+    for (int channel = 0; channel < 3; ++channel) {
+        err += sys.squaredErrorFor(vars[channel], seamlessEqs, channel)
+             + sys.squaredErrorFor(vars[channel], idEqs, channel);
+    }
+
+    out.clear();
+    out.reserve(vi.touchedCells().size());
+    for (int i : vi.touchedCells()) {
+        int v = vi.find(i % resx, i / resx);
+        vec3 p;
+        for (int channel = 0; channel < 3; ++channel)
+            p[channel] = glm::clamp(vars[channel][v], 0.0, 255.0);
+        out.push_back(std::make_pair(i, p));
+    }
+
+    return err;
+}
+
+void Solver::addSeamEquations(const SeamSampleSet& samples, int begin, int end, double alpha, int group)
+{
+    // the block Jacobi preconditioner groups the variables by the seam that first used them
+    const bool groupBySeam = (sys.backend == SolverBackend::CG_BLOCK_JACOBI);
+    int seam = std::upper_bound(samples.seamBegin.begin(), samples.seamBegin.end(), begin) - samples.seamBegin.begin() - 1;
+    auto tagNewVariables = [&](int k) {
+        while (samples.seamBegin[seam+1] <= k)
+            seam++;
+        sys.variableGroup.resize(sys.nvar, seam);
+    };
+
+    if (samples.mode == SeamSampleSet::Mode::Point) {
+        for (int k = begin; k < end; ++k) {
+            sys.addEquation(alpha * (sampleExp(samples, k, 0) == sampleExp(samples, k, 1)), group);
+            if (groupBySeam)
+                tagNewVariables(k);
+        }
+    } else {
+        // the Gauss points of a piece share their variables, their squares are summed in one block
+        std::vector<LinearExp> rows(samples.pieceSize);
+        for (int k = begin; k < end; k += samples.pieceSize) {
+            for (int j = 0; j < samples.pieceSize; ++j)
+                rows[j] = (alpha * samples.weight[k+j]) * (sampleExp(samples, k+j, 0) == sampleExp(samples, k+j, 1));
+            sys.appendSquaredSum(rows, group);
+            if (groupBySeam)
+                tagNewVariables(k);
+        }
+    }
+}
+
+void Solver::addIdentityEquations(const Image& img, double alpha, int group)
+{
+    for (int i : vi.touchedCells()) {
+        int x = i % resx;
+        int y = i / resx;
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+        //double w = 0.01;
+        sys.addEquation(
+            (1 - alpha) * (w * pixelExp(x, y)), (1 - alpha) * (w * dvec3(img.pixel(x, y))), group
+        );
+    }
+}
+
+// LinearExp as it was before the expression templates: the terms in a std::map and a temporary
+// per operation; benchmarkSeamEquations() only
+struct MapLinearExp {
+    std::map<int, scalar> terms;
+    scalar b = 0;
+
+    explicit MapLinearExp(int vari) { terms[vari] = scalar(1); }
+
+    void operator *= (scalar k){ b *= k; for (auto& t : terms) t.second *= k; }
+    void operator += (const MapLinearExp& ex){ b += ex.b; for (const auto& t : ex.terms) terms[t.first] += t.second; }
+    void operator -= (const MapLinearExp& ex){ b -= ex.b; for (const auto& t : ex.terms) terms[t.first] -= t.second; }
+
+    MapLinearExp operator + (const MapLinearExp& other) const { MapLinearExp res = *this; res += other; return res; }
+    MapLinearExp operator ==(const MapLinearExp& other) const { MapLinearExp res = *this; res -= other; return res; }
+    MapLinearExp operator * (scalar k) const { MapLinearExp res = *this; res *= k; return res; }
+};
+
+static MapLinearExp operator * (scalar k, const MapLinearExp& a) { return a * k; }
+
+static MapLinearExp mix(MapLinearExp a, MapLinearExp b, scalar t)
+{
+    return a * (1 - t) + b * t;
+}
+
+// sampleExp() on MapLinearExp, the pixels must have their variables already
+static MapLinearExp mapSampleExp(const VariableMap& vi, const SeamSampleSet& samples, int k, int side)
+{
+    auto corner = [&](int c) { return MapLinearExp(vi.find(samples.pixelX(side, c, k), samples.pixelY(side, c, k))); };
+    scalar wx = samples.wx[side][k];
+    scalar wy = samples.wy[side][k];
+    return mix(
+        mix(corner(SeamSampleSet::P00), corner(SeamSampleSet::P10), wx),
+        mix(corner(SeamSampleSet::P01), corner(SeamSampleSet::P11), wx),
+        wy
+    );
+}
+
+void Solver::benchmarkSeamEquations(const Mesh& m, int xres, int yres)
+{
+    resx = xres;
+    resy = yres;
+
+    SeamSampleSet samples(m, resx, resy);
+
+    const double alpha = 0.5;
+    const int nrep = 5;
+
+    // the variables are made by an untimed pass, then only the expressions are built, the
+    // equations are not added
+    vi.reset(resx, resy);
+    sys.clear();
+    for (int k = 0; k < samples.size(); ++k)
+        LinearExp(sampleExp(samples, k, 0) == sampleExp(samples, k, 1));
+
+    for (int templates = 0; templates < 2; ++templates) {
+        double ms = 0;
+        double sum = 0; // of the squared coefficients, the same for both
+        for (int rep = 0; rep < nrep; ++rep) {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            for (int k = 0; k < samples.size(); ++k) {
+                if (templates) {
+                    LinearExp e = alpha * (sampleExp(samples, k, 0) == sampleExp(samples, k, 1));
+                    for (const auto& t : e.terms)
+                        sum += t.second * t.second;
+                } else {
+                    MapLinearExp e = alpha * (mapSampleExp(vi, samples, k, 0) == mapSampleExp(vi, samples, k, 1));
+                    for (const auto& t : e.terms)
+                        sum += t.second * t.second;
                 }
             }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            ms += std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() / 1000.0;
         }
+        std::cout << (templates ? "Expression templates: " : "std::map LinearExp:   ") << samples.size() << " seam expressions in "
+                  << ms / nrep << " ms, sum of squared coefficients " << sum / nrep << std::endl;
+    }
+}
+
 
-        std::cout << "  Partition error = " << parterr << std::endl;
-        toterr += parterr;
+void Solver::benchmarkStoppingCriteria(const SeamSampleSet& samples, const Image& img, double alpha)
+{
+    const char *names[2] = { "residual", "quantized" };
+    Image out[2];
+    int iterations[2];
+    double ms[2];
+
+    for (int quantized = 0; quantized < 2; ++quantized) {
+        out[quantized] = img;
+        setQuantizedStopping(quantized);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        fixSeamsSeparateChannels(samples, out[quantized], alpha);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        iterations[quantized] = sys.stats.iterations;
+        ms[quantized] = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() / 1000.0;
     }
-    std::cout << "Total error = " << toterr << std::endl;
+    setQuantizedStopping(false);
+
+    // how many 8 bit outputs differ, and by how much
+    int ndiff = 0;
+    int maxdiff = 0;
+    for (int y = 0; y < img.resy; ++y) {
+        for (int x = 0; x < img.resx; ++x) {
+            for (int channel = 0; channel < 3; ++channel) {
+                int d = std::abs(int(std::round(out[0].pixel(x, y)[channel])) - int(std::round(out[1].pixel(x, y)[channel])));
+                ndiff += (d > 0);
+                maxdiff = std::max(maxdiff, d);
+            }
+        }
+    }
+
+    for (int quantized = 0; quantized < 2; ++quantized)
+        std::cout << "Stopping criterion " << names[quantized] << ": " << iterations[quantized] << " iterations, " << ms[quantized] << " ms" << std::endl;
+    if (iterations[0] > 0) {
+        std::cout << "Iterations saved: " << iterations[0] - iterations[1] << " ("
+                  << 100.0 * (iterations[0] - iterations[1]) / iterations[0] << "%)" << std::endl;
+    }
+    std::cout << ndiff << " 8 bit channel values differ, by at most " << maxdiff << std::endl;
 }
 
+void Solver::benchmarkPreconditioners(const SeamSampleSet& samples, const Image& img, double alpha)
+{
+    struct Config {
+        SolverBackend backend;
+        int icholFill;
+    };
+    const Config configs[] = {
+        { SolverBackend::LSCG,            0 },
+        { SolverBackend::CG_DIAGONAL,     0 },
+        { SolverBackend::CG_BLOCK_JACOBI, 0 },
+        { SolverBackend::CG_ICHOL,        0 },
+        { SolverBackend::CG_ICHOL,        1 },
+        { SolverBackend::CG_ICHOL,        2 }
+    };
+
+    std::vector<std::string> lines;
+    for (const Config& config : configs) {
+        Solver solver(config.backend);
+        solver.sys.verbose = false;
+        solver.setIncompleteCholeskyFill(config.icholFill);
+        Image out = img;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        solver.fixSeamsSeparateChannels(samples, out, alpha);
+        auto t1 = std::chrono::high_resolution_clock::now();
+
+        const SolverStats& stats = solver.sys.stats;
+        std::ostringstream line;
+        line << solverBackendName(config.backend);
+        if (config.backend == SolverBackend::CG_ICHOL)
+            line << " (fill " << config.icholFill << ")";
+        line << ": " << stats.iterations << " iterations, nnz(L) = " << stats.factorNonZeros
+             << ", " << std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() / 1000.0 << " ms";
+        lines.push_back(line.str());
+    }
+
+    for (const std::string& line : lines)
+        std::cout << line << std::endl;
+}
 
 int Solver::indexOf(int x, int y) const
 {
@@ -207,12 +714,14 @@ int Solver::indexOf(int x, int y) const
 
 LinearVec3 Solver::pixel(int x, int y)
 {
-    int i = indexOf(x, y);
-    if (vi[i] == -1) {
-        vi[i] = sys.nvar;
+    x = (x + resx) % resx;
+    y = (y + resy) % resy;
+    int v = vi.find(x, y);
+    if (v == -1) {
+        vi.insert(x, y, sys.nvar);
         return sys.newLinearVec3();
     } else {
-        return LinearVec3(variable(vi[i]), variable(vi[i] + 1), variable(vi[i] + 2));
+        return LinearVec3(variable(v), variable(v + 1), variable(v + 2));
     }
 }
 
@@ -242,33 +751,72 @@ LinearExp Solver::pixelExp(vec2 p)
     );
 }
 
+LinearVec3 Solver::sample(const SeamSampleSet& samples, int k, int side)
+{
+    scalar wx = samples.wx[side][k];
+    scalar wy = samples.wy[side][k];
+    return mix(
+        mix(pixel(samples.pixelX(side, SeamSampleSet::P00, k), samples.pixelY(side, SeamSampleSet::P00, k)),
+            pixel(samples.pixelX(side, SeamSampleSet::P10, k), samples.pixelY(side, SeamSampleSet::P10, k)), wx),
+        mix(pixel(samples.pixelX(side, SeamSampleSet::P01, k), samples.pixelY(side, SeamSampleSet::P01, k)),
+            pixel(samples.pixelX(side, SeamSampleSet::P11, k), samples.pixelY(side, SeamSampleSet::P11, k)), wx),
+        wy
+    );
+}
+
+LinearExp Solver::sampleExp(const SeamSampleSet& samples, int k, int side)
+{
+    scalar wx = samples.wx[side][k];
+    scalar wy = samples.wy[side][k];
+    return mix(
+        mix(pixelExp(samples.pixelX(side, SeamSampleSet::P00, k), samples.pixelY(side, SeamSampleSet::P00, k)),
+            pixelExp(samples.pixelX(side, SeamSampleSet::P10, k), samples.pixelY(side, SeamSampleSet::P10, k)), wx),
+        mix(pixelExp(samples.pixelX(side, SeamSampleSet::P01, k), samples.pixelY(side, SeamSampleSet::P01, k)),
+            pixelExp(samples.pixelX(side, SeamSampleSet::P11, k), samples.pixelY(side, SeamSampleSet::P11, k)), wx),
+        wy
+    );
+}
+
 LinearExp Solver::pixelExp(int x, int y)
 {
-    int i = indexOf(x, y);
-    if (vi[i] == -1) {
-        vi[i] = sys.nvar;
+    x = (x + resx) % resx;
+    y = (y + resy) % resy;
+    int v = vi.find(x, y);
+    if (v == -1) {
+        vi.insert(x, y, sys.nvar);
         return sys.newVar();
     } else {
-        return variable(vi[i]);
+        return variable(v);
     }
 }
 
 
 // -- SolverCompressedImage ----------------------------------------------------
 
-SolverCompressedImage::SolverCompressedImage()
+SolverCompressedImage::SolverCompressedImage(SolverBackend backend)
     : cptr{nullptr}
 {
+    sys.setBackend(backend);
+}
 
+void SolverCompressedImage::setQuantizedStopping(bool enable)
+{
+    // the endpoints are quantized to 5:6:5 bits, see quantizeColor()
+    sys.quantizationStep[0] = enable ? 8.0 : 0.0;
+    sys.quantizationStep[1] = enable ? 4.0 : 0.0;
+    sys.quantizationStep[2] = enable ? 8.0 : 0.0;
 }
 
 void SolverCompressedImage::fixSeamsSeparateChannels(const Mesh& m, const Image& img, CompressedImage& cimg, double alpha)
+{
+    fixSeamsSeparateChannels(SeamSampleSet(m, img.resx, img.resy), img, cimg, alpha);
+}
+
+void SolverCompressedImage::fixSeamsSeparateChannels(const SeamSampleSet& samples, const Image& img, CompressedImage& cimg, double alpha)
 {
     resx = img.resx;
     resy = img.resy;
 
-    vec2 uvscale(resx, resy);
-
     assert(alpha >= 0);
     assert(alpha <= 1);
 
@@ -277,59 +825,80 @@ void SolverCompressedImage::fixSeamsSeparateChannels(const Mesh& m, const Image&
     double err_seamless = 0;
     double err_id = 0;
 
-    for (int channel = 0; channel < 3; ++channel) {
-        std::cout << "Solving for channel " << channel << std::endl;
-
-        vi.clear();
-        vi.resize(cimg.nblk() * 2, -1);
+    // one cell per block endpoint, (bx * 2 + ci, by)
+    vi.reset((resx / 4) * 2, resy / 4);
 
-        sys.clear();
+    sys.clear();
 
+    const int seamlessEqs = sys.group("seamless");
+    const int idEqs = sys.group("id");
 
-        // be seamless
-        for (const Seam& s : m.seam) {
-            double d = m.maxLength(s, uvscale);
-            for (double t = 0; t <= 1; t += 1 / (2*d)) {
-                sys.addEquation(alpha * (pixelExp(m.uvpos(s.first, t) * uvscale) == pixelExp(m.uvpos(s.second, t) * uvscale)), "seamless");
+    // be seamless, same as Solver::addSeamEquations(); the texels of fixed blocks go to the
+    // right hand sides
+    if (samples.mode == SeamSampleSet::Mode::Point) {
+        for (int k = 0; k < samples.size(); ++k) {
+            dvec3 rhs = alpha * (fixedSample(samples, k, 1) - fixedSample(samples, k, 0));
+            sys.addEquation(alpha * (sampleExp(samples, k, 0) == sampleExp(samples, k, 1)), rhs, seamlessEqs);
+        }
+    } else {
+        std::vector<LinearExp> rows(samples.pieceSize);
+        std::vector<dvec3> rhs(samples.pieceSize);
+        for (int k = 0; k < samples.size(); k += samples.pieceSize) {
+            bool fixed = false;
+            for (int j = 0; j < samples.pieceSize; ++j) {
+                rows[j] = (alpha * samples.weight[k+j]) * (sampleExp(samples, k+j, 0) == sampleExp(samples, k+j, 1));
+                rhs[j] = (alpha * samples.weight[k+j]) * (fixedSample(samples, k+j, 1) - fixedSample(samples, k+j, 0));
+                fixed = fixed || (rhs[j] != dvec3(0));
+            }
+            if (!fixed) {
+                sys.appendSquaredSum(rows, seamlessEqs);
+            } else {
+                for (int j = 0; j < samples.pieceSize; ++j)
+                    sys.addEquation(rows[j], rhs[j], seamlessEqs);
             }
         }
+    }
 
-        // be yourself
-        for (int y = 0; y < resy; ++y)
-        for (int x = 0; x < resx; ++x) {
-            int bx = x / 4;
-            int by = y / 4;
-            if ((vi[indexOf(bx, by, 0)] != -1) || (vi[indexOf(bx, by, 1)] != -1)) {
-                double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1 : 0.1;
-                sys.addEquation(alpha * (w * (pixelExp(x, y) == img.pixel(x, y)[channel])), "id");
+    // be yourself, for the pixels of the blocks with a variable in scanline order
+    std::vector<int> blocks;
+    for (int i : vi.touchedCells())
+        blocks.push_back(i / 2);
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    const int nbx = resx / 4;
+    for (auto row = blocks.begin(); row != blocks.end(); ) {
+        int by = *row / nbx;
+        auto rowEnd = std::find_if(row, blocks.end(), [by, nbx](int b) { return b / nbx != by; });
+        for (int y = by * 4; y < by * 4 + 4; ++y) {
+            for (auto b = row; b != rowEnd; ++b) {
+                int bx = *b % nbx;
+                for (int x = bx * 4; x < bx * 4 + 4; ++x) {
+                    double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1 : 0.1;
+                    sys.addEquation(alpha * (w * pixelExp(x, y)), alpha * (w * dvec3(img.pixel(x, y))), idEqs);
+                }
             }
         }
+        row = rowEnd;
+    }
 
-        sys.printShort();
-
-        std::vector<scalar> vars;
-        sys.initializeVars(vars);
+    sys.printShort();
 
-        sys.solve(vars);
+    std::vector<std::vector<scalar>> vars;
+    sys.solve(vars);
 
-        err_seamless += sys.squaredErrorFor(vars, "seamless");
-        err_id += sys.squaredErrorFor(vars, "id");
-
-        for (int by = 0; by < resy/4; ++by)
-        for (int bx = 0; bx < resx/4; ++bx) {
-            int i0 = vi[indexOf(bx, by, 0)];
-            int i1 = vi[indexOf(bx, by, 1)];
-            int bi = cimg.getBlockIndex(bx * 4, by * 4);
-            if (i0 != -1) {
-                double c0val = glm::clamp(LinearExp(i0).evaluateFor(vars), 0.0, 255.0);
-                cimg.getBlock(bi).c0[channel] = c0val;
-            }
-            if (i1 != -1) {
-                double c1val = glm::clamp(LinearExp(i1).evaluateFor(vars), 0.0, 255.0);
-                cimg.getBlock(bi).c1[channel] = c1val;
-            }
+    for (int channel = 0; channel < 3; ++channel) {
+        err_seamless += sys.squaredErrorFor(vars[channel], seamlessEqs, channel);
+        err_id += sys.squaredErrorFor(vars[channel], idEqs, channel);
+    }
 
-        }
+    // the solved endpoints, clamped and quantized by setBlockColor()
+    for (int i : vi.touchedCells()) {
+        int bx = (i % vi.width()) / 2;
+        int by = i / vi.width();
+        int ci = i % 2;
+        int v = vi.find(bx * 2 + ci, by);
+        cimg.setBlockColor(bx, by, ci, vec3(vars[0][v], vars[1][v], vars[2][v]));
     }
 
     std::cout << "Error (seamless) = " << err_seamless << std::endl;
@@ -360,17 +929,22 @@ LinearVec3 SolverCompressedImage::pixel(vec2 p)
 
 LinearVec3 SolverCompressedImage::blockVars(int bx, int by, int ci)
 {
-    int i = indexOf(bx, by, ci);
-    if (vi[i] == -1) {
-        vi[i] = sys.nvar;
+    int v = vi.find(bx * 2 + ci, by);
+    if (v == -1) {
+        vi.insert(bx * 2 + ci, by, sys.nvar);
         return sys.newLinearVec3();
     } else {
-        return LinearVec3(variable(vi[i] + 0), variable(vi[i] + 1), variable(vi[i] + 2));
+        return LinearVec3(variable(v + 0), variable(v + 1), variable(v + 2));
     }
 }
 
 LinearVec3 SolverCompressedImage::pixel(int x, int y)
 {
+    if (cptr->isFixedBlock(x / 4, y / 4)) {
+        vec3 c = cptr->pixel(x, y);
+        return LinearVec3(LinearExp(scalar(c.x)), LinearExp(scalar(c.y)), LinearExp(scalar(c.z)));
+    }
+
     unsigned char bitmask = cptr->getMask(x, y);
 
     x = x / 4;
@@ -405,19 +979,54 @@ LinearExp SolverCompressedImage::pixelExp(vec2 p)
     );
 }
 
+LinearExp SolverCompressedImage::sampleExp(const SeamSampleSet& samples, int k, int side)
+{
+    scalar wx = samples.wx[side][k];
+    scalar wy = samples.wy[side][k];
+    return mix(
+        mix(pixelExp(samples.pixelX(side, SeamSampleSet::P00, k), samples.pixelY(side, SeamSampleSet::P00, k)),
+            pixelExp(samples.pixelX(side, SeamSampleSet::P10, k), samples.pixelY(side, SeamSampleSet::P10, k)), wx),
+        mix(pixelExp(samples.pixelX(side, SeamSampleSet::P01, k), samples.pixelY(side, SeamSampleSet::P01, k)),
+            pixelExp(samples.pixelX(side, SeamSampleSet::P11, k), samples.pixelY(side, SeamSampleSet::P11, k)), wx),
+        wy
+    );
+}
+
+dvec3 SolverCompressedImage::fixedSample(const SeamSampleSet& samples, int k, int side) const
+{
+    // the bilinear weights of sampleExp()
+    const SeamSampleSet::Corner corners[4] = { SeamSampleSet::P00, SeamSampleSet::P10, SeamSampleSet::P01, SeamSampleSet::P11 };
+    scalar wx = samples.wx[side][k];
+    scalar wy = samples.wy[side][k];
+    const scalar w[4] = { (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy };
+
+    dvec3 c(0);
+    for (int i = 0; i < 4; ++i) {
+        int x = samples.pixelX(side, corners[i], k);
+        int y = samples.pixelY(side, corners[i], k);
+        if (cptr->isFixedBlock(x / 4, y / 4))
+            c += w[i] * dvec3(cptr->pixel(x, y));
+    }
+    return c;
+}
+
 LinearExp SolverCompressedImage::blockVarsExp(int bx, int by, int ci)
 {
-    int i = indexOf(bx, by, ci);
-    if (vi[i] == -1) {
-        vi[i] = sys.nvar;
+    int v = vi.find(bx * 2 + ci, by);
+    if (v == -1) {
+        vi.insert(bx * 2 + ci, by, sys.nvar);
         return sys.newVar();
     } else {
-        return variable(vi[i]);
+        return variable(v);
     }
 }
 
 LinearExp SolverCompressedImage::pixelExp(int x, int y)
 {
+    // see fixedSample()
+    if (cptr->isFixedBlock(x / 4, y / 4))
+        return LinearExp();
+
     unsigned char bitmask = cptr->getMask(x, y);
 
     x = x / 4;
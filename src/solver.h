@@ -5,35 +5,97 @@
 #include "lineareq.h"
 
 #include "compressed_image.h"
+#include "variable_map.h"
+#include "seam_sample_set.h"
 
 #include <set>
 
+class FactorizationCache;
+struct CachedSeamSystem;
+
 class Solver
 {
     LinearEquationSet sys;
 
-    std::vector<int> vi; // per pixel variable index
+    FactorizationCache *cache = nullptr;
+
+    VariableMap vi; // per pixel variable index
 
     int resx;
     int resy;
 
+    // the seam equations of samples [begin, end), scaled by alpha
+    void addSeamEquations(const SeamSampleSet& samples, int begin, int end, double alpha, int group);
+
+    // the identity equations of the pixels with a variable, scaled by 1 - alpha
+    void addIdentityEquations(const Image& img, double alpha, int group);
+
+    // fixSeamsSeparateChannels() with SolverBackend::CG_MATRIX_FREE
+    void solveMatrixFree(const SeamSampleSet& samples, Image& img, double alpha);
+
+    // fixSeamsSeparateChannels() with the factors of an earlier solve on the same seams
+    void solveCached(const CachedSeamSystem& entry, Image& img);
+
+    // takes the backend and its settings of other, but none of its equations
+    void configureLike(const Solver& other);
+
+    // solves the equations of one partition, out gets the new value of each of its pixels
+    double solvePartition(const SeamSampleSet& samples, const Image& img, const std::vector<int>& seams, std::vector<std::pair<int, vec3>>& out);
+
 public:
-    Solver();
+    explicit Solver(SolverBackend backend = SolverBackend::LDLT_AMD);
+
+    // reuse the factorization of the seam system across textures with the same seams,
+    // used by fixSeamsSeparateChannels(samples, img, alpha) with the LDLT backends
+    void setFactorizationCache(FactorizationCache *factorizationCache) { cache = factorizationCache; }
+
+    // the iterative backends stop once the 8 bit output would no longer change, instead of
+    // at the residual tolerance
+    void setQuantizedStopping(bool enable);
 
+    // cg-ichol: fill level of the incomplete factor, see LinearEquationSet::icholFill
+    void setIncompleteCholeskyFill(int level) { sys.icholFill = level; }
+
+    // the iterative backends split their matrix products over the threads, see
+    // LinearEquationSet::parallelProducts
+    void setParallelProducts(bool enable) { sys.parallelProducts = enable; }
+
+    // the Mesh overloads sample the seams at the resolution of img
     void fixSeams(const Mesh& m, Image& img);
+    void fixSeams(const SeamSampleSet& samples, Image& img);
 
     // alpha = relative weight of the seamless equations block
     void fixSeamsSeparateChannels(const Mesh& m, Image& img, double alpha);
+    void fixSeamsSeparateChannels(const SeamSampleSet& samples, Image& img, double alpha);
+
+    // solves at 1/2^levels, ..., 1/2 of the resolution first and starts each finer level
+    // from the correction of the coarser one; the guess only matters to the iterative backends,
+    // with the others only the full resolution is solved
+    void fixSeamsCoarseToFine(const Mesh& m, const SeamSampleSet& samples, Image& img, double alpha, int levels = 2);
 
+    // the partitions must not share pixels, they are solved in parallel
     void fixSeamsSeparateChannels(const Mesh& m, Image& img, const std::vector<std::vector<Seam>>& vsv);
+    void fixSeamsSeparateChannels(const SeamSampleSet& samples, Image& img, const std::vector<std::vector<int>>& partitions);
+
+    // times the construction of the seam expressions with the expression templates and with the
+    // std::map LinearExp they replaced, without adding the equations
+    void benchmarkSeamEquations(const Mesh& m, int xres, int yres);
+
+    // solves with both stopping criteria and reports the iterations saved
+    void benchmarkStoppingCriteria(const SeamSampleSet& samples, const Image& img, double alpha);
+
+    // solves with the preconditioned CG backends and reports their iterations
+    void benchmarkPreconditioners(const SeamSampleSet& samples, const Image& img, double alpha);
 
     // multi channel
     LinearVec3 pixel(int x, int y);
     LinearVec3 pixel(vec2 p); // bilinear interpolation
+    LinearVec3 sample(const SeamSampleSet& samples, int k, int side);
 
     // single channel
     LinearExp pixelExp(int x, int y);
     LinearExp pixelExp(vec2 p); // bilinear interpolation
+    LinearExp sampleExp(const SeamSampleSet& samples, int k, int side);
 
     int indexOf(int x, int y) const; // TODO copy to img
 
@@ -41,21 +103,28 @@ public:
 
 class SolverCompressedImage {
     LinearEquationSet sys; // same as solver
-    std::vector<int> vi; // same as solver
+    VariableMap vi; // per block endpoint variable index, cell (bx * 2 + ci, by)
     int resx; // same as solver
     int resy; // same as solver
 
     CompressedImage *cptr;
 
 public:
-    SolverCompressedImage();
+    explicit SolverCompressedImage(SolverBackend backend = SolverBackend::LDLT_AMD);
+
+    // same as Solver, at the precision of the quantized endpoints
+    void setQuantizedStopping(bool enable);
+
+    // same as Solver
+    void setParallelProducts(bool enable) { sys.parallelProducts = enable; }
 
     void fixSeams(const Mesh& m, const Image& img, CompressedImage& cimg, const std::set<int>& fixedBlocks);
 
     // alpha = relative weight of the seamless equations block
     void fixSeamsSeparateChannels(const Mesh& m, const Image& img, CompressedImage& cimg, double alpha);
+    void fixSeamsSeparateChannels(const SeamSampleSet& samples, const Image& img, CompressedImage& cimg, double alpha);
 
-    int indexOf(int bx, int by, int ci) const;
+    int indexOf(int bx, int by, int ci) const; // cell of vi, as y * width + x
     LinearVec3 pixel(int x, int y);
     LinearVec3 pixel(vec2 p); // same as Solver
     LinearVec3 blockVars(int bx, int by, int ci);
@@ -63,8 +132,13 @@ public:
 
     LinearExp pixelExp(int x, int y);
     LinearExp pixelExp(vec2 p); // same as Solver
+    LinearExp sampleExp(const SeamSampleSet& samples, int k, int side); // same as Solver
     LinearExp blockVarsExp(int bx, int by, int ci);
 
+    // the texels of the fixed blocks (CompressedImage::isFixedBlock()) are left out of the
+    // expressions above, this is their part of sample k on side
+    dvec3 fixedSample(const SeamSampleSet& samples, int k, int side) const;
+
 
 
 };
@@ -0,0 +1,71 @@
+#ifndef VARIABLE_MAP_H
+#define VARIABLE_MAP_H
+
+#include <cassert>
+#include <vector>
+
+// Maps the cells of a w x h grid (pixels, block endpoints) to variable indices.
+// Usually only a few cells get a variable, so the grid is split in tiles of
+// TILE_SIZE x TILE_SIZE cells and a tile is allocated when one of its cells is set.
+// The set cells are also listed, in insertion order, as y * w + x.
+class VariableMap
+{
+    static constexpr int TILE_BITS = 4;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+
+    int w = 0;
+    int h = 0;
+    int ntx = 0;
+
+    std::vector<int> tile;      // per tile, offset of its cells or -1
+    std::vector<int> cells;     // the cells of the allocated tiles
+    std::vector<int> allocated; // the allocated tiles
+    std::vector<int> touched;   // the cells set since the last reset
+
+public:
+
+    // unmaps every cell, the memory is kept when the size does not change
+    void reset(int xres, int yres)
+    {
+        if (xres != w || yres != h) {
+            w = xres;
+            h = yres;
+            ntx = (w + TILE_MASK) >> TILE_BITS;
+            tile.assign(ntx * ((h + TILE_MASK) >> TILE_BITS), -1);
+        } else {
+            for (int t : allocated)
+                tile[t] = -1;
+        }
+        cells.clear();
+        allocated.clear();
+        touched.clear();
+    }
+
+    // -1 if the cell has no variable
+    int find(int x, int y) const
+    {
+        assert(x >= 0 && x < w && y >= 0 && y < h);
+        int offset = tile[(y >> TILE_BITS) * ntx + (x >> TILE_BITS)];
+        return (offset == -1) ? -1 : cells[offset + ((y & TILE_MASK) << TILE_BITS) + (x & TILE_MASK)];
+    }
+
+    void insert(int x, int y, int v)
+    {
+        assert(find(x, y) == -1);
+        int t = (y >> TILE_BITS) * ntx + (x >> TILE_BITS);
+        if (tile[t] == -1) {
+            tile[t] = cells.size();
+            cells.resize(cells.size() + TILE_SIZE * TILE_SIZE, -1);
+            allocated.push_back(t);
+        }
+        cells[tile[t] + ((y & TILE_MASK) << TILE_BITS) + (x & TILE_MASK)] = v;
+        touched.push_back(y * w + x);
+    }
+
+    int width() const { return w; }
+
+    const std::vector<int>& touchedCells() const { return touched; }
+};
+
+#endif // VARIABLE_MAP_H